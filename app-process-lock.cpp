@@ -0,0 +1,438 @@
+#include "app-process-lock.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+static std::string
+toBase64(const std::string &input)
+{
+    //Same encoding as QByteArray::toBase64() (standard alphabet, padded)
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string output;
+    output.reserve((input.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < input.size(); i += 3)
+    {
+        unsigned int chunk = (unsigned char)input[i] << 16;
+        if (i + 1 < input.size()) chunk |= (unsigned char)input[i + 1] << 8;
+        if (i + 2 < input.size()) chunk |= (unsigned char)input[i + 2];
+        output += alphabet[(chunk >> 18) & 0x3f];
+        output += alphabet[(chunk >> 12) & 0x3f];
+        output += i + 1 < input.size() ? alphabet[(chunk >> 6) & 0x3f] : '=';
+        output += i + 2 < input.size() ? alphabet[chunk & 0x3f] : '=';
+    }
+    return output;
+}
+
+static bool
+readUInt(std::istream &stream, int size, unsigned long long &value)
+{
+    //Big-endian, as written by QDataStream
+    value = 0;
+    for (int i = 0; i < size; i++)
+    {
+        int c = stream.get();
+        if (c == EOF) return false;
+        value = (value << 8) | (unsigned char)c;
+    }
+    return true;
+}
+
+static bool
+skipString(std::istream &stream)
+{
+    //QByteArray or QString (QDataStream): size in bytes, 0xffffffff if null
+    unsigned long long size = 0;
+    if (!readUInt(stream, 4, size)) return false;
+    if (size != 0xffffffff) stream.ignore(size);
+    return (bool)stream;
+}
+
+static std::string
+getEnv(const char *name)
+{
+    const char *value = getenv(name);
+    return value ? value : "";
+}
+
+long long
+ApplicationLock::processStartTime(long long pid)
+{
+    long long start_time = 0;
+
+#if defined(__linux__)
+
+    //Field 22 of /proc/<pid>/stat, clock ticks after boot
+    //The command name (field 2) may contain spaces and parentheses,
+    //so the fields are counted from the last closing parenthesis
+    std::ifstream stat_file("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    if (std::getline(stat_file, stat))
+    {
+        size_t pos = stat.rfind(')');
+        if (pos != std::string::npos)
+        {
+            std::istringstream fields(stat.substr(pos + 2));
+            std::string field;
+            for (int i = 0; i < 20 && fields >> field; i++)
+            {
+                if (i == 19) start_time = std::atoll(field.c_str()); //field 3 is at 0
+            }
+        }
+    }
+
+#endif
+
+    return start_time;
+}
+
+bool
+ApplicationLock::isProcessGone(long long pid, long long start_time)
+{
+    //true if process gone, false in doubt
+    if (pid <= 0) return false;
+
+#if !defined(_WIN32)
+
+    //No such process - a definitive answer, in any scope
+    //No permission (other user) means that the process exists
+    if (kill((pid_t)pid, 0) != 0 && errno == ESRCH)
+        return true;
+
+    //If the pid has been reused by another process after the owner
+    //has crashed, the start time is different
+    if (start_time)
+    {
+        long long current_start_time = processStartTime(pid);
+        if (current_start_time && current_start_time != start_time)
+            return true;
+    }
+
+#else
+    (void)start_time;
+#endif
+
+    return false;
+}
+
+bool
+ApplicationLock::waitForProcessExit(long long pid, long long start_time, int timeout)
+{
+    //Unknown pid, nothing to wait for
+    if (pid <= 0) return false;
+    if (isProcessGone(pid, start_time)) return true;
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+
+    //A pidfd becomes readable when the process exits (Linux 5.3)
+    //The start time is checked after opening it, to make sure that
+    //it refers to the same process, not a new one with the same pid
+    int pidfd = syscall(SYS_pidfd_open, (pid_t)pid, 0);
+    if (pidfd == -1 && errno == ESRCH) return true;
+    if (pidfd != -1)
+    {
+        if (start_time && processStartTime(pid) != start_time)
+        {
+            ::close(pidfd);
+            return true;
+        }
+        struct pollfd pfd;
+        pfd.fd = pidfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int rc = 0;
+        do rc = poll(&pfd, 1, timeout);
+        while (rc == -1 && errno == EINTR && timeout < 0);
+        ::close(pidfd);
+        return rc > 0;
+    }
+
+#endif
+
+    //No pidfd (old kernel, other platform), check periodically
+    auto start = std::chrono::steady_clock::now();
+    while (!isProcessGone(pid, start_time))
+    {
+        int wait = 100;
+        if (timeout >= 0)
+        {
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            if (elapsed >= timeout) return false;
+            if (timeout - elapsed < wait) wait = timeout - elapsed;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+    }
+
+    return true;
+}
+
+std::string
+ApplicationLock::getUsername()
+{
+    std::string username;
+
+#if !defined(_WIN32)
+    //Same as QApplicationLock, empty without a login session
+    const char *login = getlogin();
+    if (login) username = login;
+#endif
+
+    return username;
+}
+
+std::string
+ApplicationLock::getSessionId()
+{
+    //See QApplicationLock::getSessionId(), DISPLAY identifies an X11 session
+    std::string sid = getEnv("XDG_SESSION_ID");
+    std::string display_id = getEnv("DISPLAY");
+    if (!display_id.empty())
+        sid = "DISPLAY=" + display_id;
+    return sid;
+}
+
+std::string
+ApplicationLock::lockName(const std::string &name, int scope)
+{
+    //Make lock name, unique for application + [user/session]
+    //Must match QApplicationLock::lockName()
+    std::string lock_name = "(QApplicationLock)" + name;
+    if (scope & User)
+        lock_name += "|" + getUsername();
+    if (scope & X11)
+        lock_name += "|" + getSessionId();
+
+    //Encode to avoid problematic characters ("/!\n") ending up in a filename
+    return toBase64(lock_name);
+}
+
+ApplicationLock::ApplicationLock(const std::string &name, int scope)
+               : m_name(name),
+                 m_scope(scope)
+{
+    if (m_name.empty())
+        throw std::invalid_argument("name argument missing (unique application name)");
+    if (!(m_scope & User))
+        throw std::invalid_argument("system-global scope not supported (lock file)");
+    if (m_scope & (Socket | Mapped))
+        throw std::invalid_argument("socket and mapped mode not supported (file mode only)");
+
+    //Same guard file as QApplicationLock (file mode, kernel lock)
+    std::string lock_dir = getEnv("TMPDIR");
+    while (lock_dir.size() > 1 && lock_dir[lock_dir.size() - 1] == '/')
+        lock_dir.erase(lock_dir.size() - 1);
+    if (lock_dir.empty()) lock_dir = "/tmp";
+    m_lock_file_path = lock_dir + "/." + lockName(m_name, m_scope) + ".flock";
+    m_heartbeat_file_path = lock_dir + "/." + lockName(m_name, m_scope) + ".lck";
+}
+
+ApplicationLock::~ApplicationLock()
+{
+    unlock();
+}
+
+void
+ApplicationLock::setLockFilePath(const std::string &path)
+{
+    m_lock_file_path = path;
+}
+
+const std::string&
+ApplicationLock::lockFilePath() const
+{
+    return m_lock_file_path;
+}
+
+void
+ApplicationLock::setStaleTimeout(int msec)
+{
+    m_stale_timeout = msec;
+}
+
+bool
+ApplicationLock::tryLock(bool *busy_ptr)
+{
+    if (busy_ptr) *busy_ptr = false;
+    if (m_fd != -1) return true;
+
+#if !defined(_WIN32)
+
+    int fd = ::open(m_lock_file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return false;
+
+    int rc = -1;
+#if defined(F_OFD_SETLK)
+    //Open file description lock (Linux 3.15), owned by this fd
+    //Unlike a classic POSIX lock, it's not dropped when another fd
+    //of this process on the same file is closed
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    rc = fcntl(fd, F_OFD_SETLK, &fl);
+    if (rc == -1 && errno == EINVAL) //older kernel
+        rc = flock(fd, LOCK_EX | LOCK_NB);
+#else
+    rc = flock(fd, LOCK_EX | LOCK_NB);
+#endif
+
+    if (rc == 0)
+    {
+        m_fd = fd;
+        writeOwner();
+        return true;
+    }
+
+    int err = errno;
+    ::close(fd);
+    if (busy_ptr && (err == EAGAIN || err == EACCES || err == EWOULDBLOCK))
+        *busy_ptr = true;
+
+#endif
+
+    return false;
+}
+
+bool
+ApplicationLock::lock(int timeout)
+{
+    auto start = std::chrono::steady_clock::now();
+    bool busy = false;
+    while (!tryLock(&busy))
+    {
+        if (!busy) return false; //error
+
+        //Wait for the owner to exit, but check the lock again after a while,
+        //it might be released without the process exiting
+        int wait = 100;
+        if (timeout >= 0)
+        {
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            if (elapsed >= timeout) return false;
+            if (timeout - elapsed < wait) wait = timeout - elapsed;
+        }
+        long long start_time = 0;
+        long long pid = ownerPid(&start_time);
+        if (!waitForProcessExit(pid, start_time, wait) && pid <= 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+    }
+
+    return true;
+}
+
+void
+ApplicationLock::unlock()
+{
+#if !defined(_WIN32)
+    //Closing the fd releases the lock, the lock file is not removed
+    //(removing it would allow two processes to lock different files)
+    if (m_fd != -1)
+        ::close(m_fd);
+#endif
+    m_fd = -1;
+}
+
+bool
+ApplicationLock::isLocked() const
+{
+    return m_fd != -1;
+}
+
+bool
+ApplicationLock::isSecondaryInstance(long long *pid_ptr)
+{
+    bool was_locked = isLocked();
+    bool busy = false;
+    tryLock(&busy);
+    long long pid = busy ? ownerPid() : 0;
+
+    //A QApplicationLock without the kernel lock only has its lock file,
+    //it's running if that has a live heartbeat
+    if (!was_locked && !busy && (pid = heartbeatOwner()) != 0)
+    {
+        unlock();
+        busy = true;
+    }
+
+    if (pid_ptr) *pid_ptr = pid;
+    return busy;
+}
+
+long long
+ApplicationLock::ownerPid(long long *start_time_ptr) const
+{
+    //"<pid> <start time>\n", written by the owner after locking
+    long long pid = 0, start_time = 0;
+    std::ifstream lock_file(m_lock_file_path);
+    if (!(lock_file >> pid >> start_time)) pid = start_time = 0;
+    if (start_time_ptr) *start_time_ptr = start_time;
+    return pid;
+}
+
+bool
+ApplicationLock::writeOwner()
+{
+    //Record owner, in place (the file must not be replaced)
+    //Written before truncating, so there's no empty file in between
+    bool ok = false;
+
+#if !defined(_WIN32)
+    long long pid = getpid();
+    std::string owner = std::to_string(pid) + " " + std::to_string(processStartTime(pid)) + "\n";
+    ok = pwrite(m_fd, owner.data(), owner.size(), 0) == (ssize_t)owner.size() &&
+         ftruncate(m_fd, owner.size()) == 0;
+#endif
+
+    return ok;
+}
+
+long long
+ApplicationLock::heartbeatOwner() const
+{
+    //Owner of the lock file of QApplicationLock (file mode), 0 if there's
+    //none or it's stale: the owner is gone or the heartbeat (mtime) is older
+    //than the stale timeout (QApplicationLock would take it over)
+    //Record: magic, sequence, segment (QByteArray), checksum (QDataStream)
+    //Segment: time, title, pid, request, interval, start time, ...
+    long long pid = 0;
+
+#if !defined(_WIN32)
+    struct stat st;
+    std::ifstream lock_file(m_heartbeat_file_path, std::ios::binary);
+    if (!lock_file || stat(m_heartbeat_file_path.c_str(), &st) != 0) return 0;
+    if (((long long)time(0) - st.st_mtime) * 1000 > m_stale_timeout) return 0;
+
+    std::istringstream record(std::string((std::istreambuf_iterator<char>(lock_file)), std::istreambuf_iterator<char>()));
+    unsigned long long magic = 0, seq = 0, size = 0, value = 0, interval = 0, start_time = 0;
+    bool ok = readUInt(record, 4, magic) && magic == 0x514c434b && //QLCK
+        readUInt(record, 4, seq) && readUInt(record, 4, size) &&
+        readUInt(record, 8, value) && //time
+        skipString(record) && //title
+        readUInt(record, 8, value) && //pid
+        record.ignore(1) && //request
+        readUInt(record, 8, interval) &&
+        readUInt(record, 8, start_time);
+    if (ok && !isProcessGone((long long)value, (long long)start_time))
+        pid = (long long)value;
+#endif
+
+    return pid;
+}
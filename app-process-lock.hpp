@@ -0,0 +1,191 @@
+/****************************************************************************
+ *
+ * ApplicationLock
+ * Copyright (C) 2025 Philip Seeger <p@c0xc.net>
+ *
+ * This module is licensed under the MIT License.
+ *
+ * Qt-free core of QApplicationLock, for daemons and command line tools.
+ *
+****************************************************************************/
+
+#ifndef APP_PROCESS_LOCK_HPP
+#define APP_PROCESS_LOCK_HPP
+
+#include <string>
+
+/**
+ * ApplicationLock limits a program to a single instance,
+ * without Qt and without an event loop (C++11, POSIX).
+ *
+ * The primary instance holds an exclusive kernel lock (OFD lock on Linux,
+ * flock() elsewhere) on a lock file, which is released by the kernel
+ * when the process exits or crashes. So there's no heartbeat, no thread
+ * and no stale lock; checking and taking the lock is a single syscall.
+ *
+ * The lock file is the same guard file that QApplicationLock uses
+ * in file mode with the kernel lock enabled (same name and scope).
+ * The holder writes its pid and start time into the lock file.
+ *
+ * This is not the decision logic of QApplicationLock, which has its own
+ * lock modes. Only the file mode (User scope, the default) is shared:
+ * isSecondaryInstance() detects a QApplicationLock in file mode,
+ * with the kernel lock or by the heartbeat of its lock file
+ * (see setStaleTimeout()), and a QApplicationLock in file mode detects
+ * this lock by its guard file. The other modes (global shmem, mapped,
+ * socket) can't be detected, so these scopes are refused.
+ *
+ * Not supported on Windows (the lock can't be acquired).
+ */
+class ApplicationLock
+{
+
+public:
+
+    //Same values as QApplicationLock::Scope
+    //Global, Socket and Mapped are not supported (other lock modes)
+    enum Scope
+    {
+        Global  = 0,
+        User    = 1 << 1,
+        X11     = 1 << 2,
+        Socket  = 1 << 3,
+        Mapped  = 1 << 4,
+    };
+
+    /**
+     * Start time of the process, 0 if unknown (see QApplicationLock).
+     */
+    static long long
+    processStartTime(long long pid);
+
+    /**
+     * Returns true if the process is definitely gone,
+     * i.e., there's no such process or the pid has been reused
+     * (start time differs, if known). False if it's running or in doubt.
+     */
+    static bool
+    isProcessGone(long long pid, long long start_time = 0);
+
+    /**
+     * Waits until the process has exited, at most timeout ms (-1: forever).
+     * Uses a pidfd on Linux, otherwise it checks periodically.
+     * Returns true if the process is gone.
+     */
+    static bool
+    waitForProcessExit(long long pid, long long start_time = 0, int timeout = -1);
+
+    static std::string
+    getUsername();
+
+    static std::string
+    getSessionId();
+
+    /**
+     * Lock name as used in the lock file name (base64-encoded),
+     * unique for application + [user/session].
+     */
+    static std::string
+    lockName(const std::string &name, int scope);
+
+    /**
+     * Creates a lock instance for the named application (must be unique).
+     * The lock file is placed in $TMPDIR (or /tmp), like the lock file
+     * of QApplicationLock. The lock is not acquired yet.
+     * Throws std::invalid_argument if the name is empty, if the scope
+     * is global or if it has the Socket or Mapped flag: those are other
+     * lock modes of QApplicationLock, which this lock can't detect.
+     */
+    ApplicationLock(const std::string &name, int scope = User);
+    ~ApplicationLock();
+
+    ApplicationLock(const ApplicationLock&) = delete;
+    ApplicationLock&
+    operator=(const ApplicationLock&) = delete;
+
+    /**
+     * Overrides the lock file path, must be called before locking.
+     */
+    void
+    setLockFilePath(const std::string &path);
+
+    const std::string&
+    lockFilePath() const;
+
+    /**
+     * Heartbeat age (ms) after which the lock file of a QApplicationLock
+     * without the kernel lock is considered stale, see isSecondaryInstance().
+     * Defaults to 15 seconds, like QApplicationLock.
+     */
+    void
+    setStaleTimeout(int msec);
+
+    /**
+     * Tries to acquire the lock, without blocking.
+     * Returns true if this process holds the lock (now or already).
+     * If another process holds it, busy_ptr is set to true.
+     * On error (lock file can't be opened), both are false.
+     */
+    bool
+    tryLock(bool *busy_ptr = 0);
+
+    /**
+     * Blocks until the lock is acquired, at most timeout ms (-1: forever).
+     */
+    bool
+    lock(int timeout = -1);
+
+    void
+    unlock();
+
+    bool
+    isLocked() const;
+
+    /**
+     * Tries to acquire the lock and returns true if another instance
+     * holds it. In case of an error, it won't return true.
+     *
+     * A QApplicationLock without the kernel lock (default) doesn't hold it,
+     * so its lock file is checked as well: if the owner process is running
+     * and the heartbeat (mtime) isn't stale, that instance is the primary
+     * instance and the lock is released again.
+     */
+    bool
+    isSecondaryInstance(long long *pid_ptr = 0);
+
+    /**
+     * Pid (and start time) of the process holding the lock,
+     * as recorded in the lock file, 0 if unknown.
+     */
+    long long
+    ownerPid(long long *start_time_ptr = 0) const;
+
+private:
+
+    bool
+    writeOwner();
+
+    long long
+    heartbeatOwner() const;
+
+    std::string
+    m_name;
+
+    int
+    m_scope;
+
+    std::string
+    m_lock_file_path;
+
+    std::string
+    m_heartbeat_file_path; //lock file of QApplicationLock (file mode)
+
+    int
+    m_stale_timeout = 15000;
+
+    int
+    m_fd = -1;
+
+};
+
+#endif
@@ -0,0 +1 @@
+../app-process-lock.cpp
\ No newline at end of file
@@ -0,0 +1,428 @@
+#include "bench.hpp"
+
+QApplicationLock*
+QApplicationLockBench::createLock(const QString &name, const QString &mode)
+{
+    QApplicationLock *lock = 0;
+    if (mode == "shmem")
+    {
+        lock = new QApplicationLock(name, QApplicationLock::Scope::Global);
+    }
+    else if (mode == "file" || mode == "kernel")
+    {
+        lock = new QApplicationLock(name, QApplicationLock::Scope::User);
+        lock->setKernelLockEnabled(mode == "kernel");
+    }
+    else if (mode == "mapped")
+    {
+        lock = new QApplicationLock(name, QApplicationLock::Scope::User | QApplicationLock::Scope::Mapped);
+    }
+    else if (mode == "socket")
+    {
+        lock = new QApplicationLock(name, QApplicationLock::Scope::User | QApplicationLock::Scope::Socket);
+    }
+    return lock;
+}
+
+qint64
+QApplicationLockBench::steadyNanoseconds()
+{
+    //Same clock in all processes (CLOCK_MONOTONIC on Linux)
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+void
+QApplicationLockBench::addModes(bool with_socket)
+{
+    QTest::addColumn<QString>("mode");
+    QTest::newRow("shmem") << "shmem";
+    QTest::newRow("file") << "file";
+    QTest::newRow("kernel") << "kernel";
+    QTest::newRow("mapped") << "mapped";
+    if (with_socket)
+        QTest::newRow("socket") << "socket";
+}
+
+QString
+QApplicationLockBench::uniqueName()
+{
+    return QString("qapp-lock-bench-%1-%2").arg(QCoreApplication::applicationPid()).arg(++m_counter);
+}
+
+qint64
+QApplicationLockBench::countSyscalls(const QString &strace, const QString &mode, int ticks)
+{
+    //Syscalls of a process that runs the given number of heartbeat ticks,
+    //-1 on error
+    QTemporaryFile output;
+    if (!output.open()) return -1;
+    QProcess process;
+    process.start(strace, QStringList() << "-f" << "-c" << "-o" << output.fileName()
+        << QCoreApplication::applicationFilePath() << "--tick" << mode << uniqueName() << QString::number(ticks));
+    if (!process.waitForFinished(60000) || process.exitCode() != 0) return -1;
+
+    //Summary table, the last line is the total:
+    //% time, seconds, [usecs/call,] calls, [errors,] "total"
+    //The columns are right-aligned and empty ones are left out
+    //(usecs/call in older versions, errors if there are none),
+    //so the calls are found from the right: the field before "total",
+    //or the one before that if the last one is in the errors column
+    QStringList lines = QString::fromLocal8Bit(output.readAll()).trimmed().split('\n');
+    QString header, total = lines.last();
+    for (const QString &line : lines)
+    {
+        if (line.contains("calls") && line.contains("syscall"))
+        {
+            header = line;
+            break;
+        }
+    }
+    QStringList fields = total.simplified().split(' ');
+    if (header.isEmpty() || fields.size() < 3 || fields.last() != "total") return -1;
+    fields.removeLast();
+    int errors_end = header.indexOf("errors") + 6;
+    int value_end = total.lastIndexOf(fields.last()) + fields.last().size();
+    if (header.contains("errors") && value_end == errors_end)
+        fields.removeLast();
+    bool ok = false;
+    qint64 calls = fields.last().toLongLong(&ok);
+    return ok ? calls : -1;
+}
+
+void
+QApplicationLockBench::decisionFresh_data()
+{
+    addModes();
+}
+
+void
+QApplicationLockBench::decisionFresh()
+{
+    //isSecondaryInstance() without an existing lock (lock is created)
+    QFETCH(QString, mode);
+
+    qint64 total = 0;
+    for (int i = 0; i < m_iterations; i++)
+    {
+        QScopedPointer<QApplicationLock> lock(createLock(uniqueName(), mode));
+        qint64 start = steadyNanoseconds();
+        bool secondary = lock->isSecondaryInstance();
+        total += steadyNanoseconds() - start;
+        QVERIFY(!secondary);
+    }
+
+    QTest::setBenchmarkResult(total / m_iterations, QTest::WalltimeNanoseconds);
+}
+
+void
+QApplicationLockBench::decisionPrimary_data()
+{
+    addModes();
+}
+
+void
+QApplicationLockBench::decisionPrimary()
+{
+    //isSecondaryInstance() with a live primary instance (other process)
+    QFETCH(QString, mode);
+    QString name = uniqueName();
+
+    QProcess primary;
+    primary.start(QCoreApplication::applicationFilePath(), QStringList() << "--hold" << mode << name);
+    QVERIFY(primary.waitForReadyRead(10000)); //ready
+
+    qint64 total = 0;
+    for (int i = 0; i < m_iterations; i++)
+    {
+        QScopedPointer<QApplicationLock> lock(createLock(name, mode));
+        qint64 start = steadyNanoseconds();
+        bool secondary = lock->isSecondaryInstance();
+        total += steadyNanoseconds() - start;
+        QVERIFY(secondary);
+    }
+
+    primary.closeWriteChannel(); //quit
+    primary.waitForFinished();
+
+    QTest::setBenchmarkResult(total / m_iterations, QTest::WalltimeNanoseconds);
+}
+
+void
+QApplicationLockBench::decisionStale_data()
+{
+    addModes();
+}
+
+void
+QApplicationLockBench::decisionStale()
+{
+    //isSecondaryInstance() with a leftover lock of a crashed instance
+    //The lock is created by another process, which is killed (SIGKILL),
+    //so it's left behind as after a crash
+    QFETCH(QString, mode);
+
+    qint64 total = 0;
+    for (int i = 0; i < m_stale_iterations; i++)
+    {
+        QString name = uniqueName();
+        QProcess primary;
+        primary.start(QCoreApplication::applicationFilePath(), QStringList() << "--hold" << mode << name);
+        QVERIFY(primary.waitForReadyRead(10000)); //ready
+        primary.kill();
+        QVERIFY(primary.waitForFinished());
+
+        QScopedPointer<QApplicationLock> lock(createLock(name, mode));
+        qint64 start = steadyNanoseconds();
+        bool secondary = lock->isSecondaryInstance();
+        total += steadyNanoseconds() - start;
+        QVERIFY(!secondary);
+    }
+
+    QTest::setBenchmarkResult(total / m_stale_iterations, QTest::WalltimeNanoseconds);
+}
+
+void
+QApplicationLockBench::updateLock_data()
+{
+    //No heartbeat in socket mode
+    addModes(false);
+}
+
+void
+QApplicationLockBench::updateLock()
+{
+    //Cost of one timer tick of the primary instance
+    QFETCH(QString, mode);
+
+    QScopedPointer<QApplicationLock> lock(createLock(uniqueName(), mode));
+    QVERIFY(!lock->isSecondaryInstance());
+
+    QBENCHMARK
+    {
+        lock->updateLock();
+    }
+}
+
+void
+QApplicationLockBench::updateLockSyscalls_data()
+{
+    //file-baseline: the file mode tick before the heartbeat was written
+    //through the open lock file (stat and utime by path)
+    addModes(false);
+    QTest::newRow("file-baseline") << "file-baseline";
+}
+
+void
+QApplicationLockBench::updateLockSyscalls()
+{
+    //Syscalls per timer tick of the primary instance, the difference
+    //between a process running m_syscall_ticks ticks and one running none
+    //(same setup), so only the ticks are counted
+    QFETCH(QString, mode);
+    QString strace = QStandardPaths::findExecutable("strace");
+    if (strace.isEmpty()) QSKIP("strace not found");
+
+    qint64 idle = countSyscalls(strace, mode, 0);
+    qint64 busy = countSyscalls(strace, mode, m_syscall_ticks);
+    QVERIFY(idle > 0 && busy >= idle);
+    qreal per_tick = (qreal)(busy - idle) / m_syscall_ticks;
+    m_tick_syscalls[mode] = per_tick;
+
+    //The heartbeat through the open lock file must be cheaper than
+    //the one by path (the file row runs first, unless it's skipped)
+    if (mode == "file-baseline" && m_tick_syscalls.contains("file"))
+        QVERIFY2(m_tick_syscalls["file"] < per_tick, qPrintable(QString("file: %1, file-baseline: %2 syscalls per tick").arg(m_tick_syscalls["file"]).arg(per_tick)));
+
+    QTest::setBenchmarkResult(per_tick, QTest::Events);
+}
+
+static QByteArray
+serializeBaselineSegment(const QApplicationLock::Segment &segment)
+{
+    //Segment as it was serialized before the fixed layout (shmem mode)
+    QByteArray bytes;
+    QDataStream stream(&bytes, QIODevice::WriteOnly);
+    stream << segment.time << segment.title << segment.pid << segment.request;
+    stream << (qint8)'E'; //end mark
+    return bytes;
+}
+
+void
+QApplicationLockBench::updateLockBaseline()
+{
+    //Cost of one timer tick in shmem mode before the fixed segment layout,
+    //to be compared with the shmem row of updateLock:
+    //the segment (64 KB) was copied and deserialized under the
+    //QSharedMemory semaphore, then serialized and written back under it
+    QSharedMemory shmem(uniqueName());
+    QVERIFY(shmem.create(1024*64));
+    QApplicationLock::Segment seg{};
+    seg.pid = QCoreApplication::applicationPid();
+    QByteArray bytes = serializeBaselineSegment(seg);
+    memcpy(shmem.data(), bytes.constData(), bytes.size());
+
+    QBENCHMARK
+    {
+        shmem.lock();
+        QByteArray data((const char*)shmem.constData(), shmem.size());
+        shmem.unlock();
+
+        qint8 end = 0;
+        QDataStream in(data);
+        in >> seg.time >> seg.title >> seg.pid >> seg.request >> end;
+        seg.time = QApplicationLock::timestamp(true);
+        seg.request = false;
+
+        bytes = serializeBaselineSegment(seg);
+        shmem.lock();
+        memcpy(shmem.data(), bytes.constData(), bytes.size());
+        shmem.unlock();
+    }
+}
+
+void
+QApplicationLockBench::writeFile()
+{
+    //Lock file write (record read and updated in place), as done for
+    //a request, here by the lease renewal, which rewrites the record
+    //on every timer tick
+    QTemporaryDir lease_dir;
+    QVERIFY(lease_dir.isValid());
+    QScopedPointer<QApplicationLock> lock(createLock(uniqueName(), "file"));
+    lock->setLeaseMode(lease_dir.path());
+    QVERIFY(!lock->isSecondaryInstance());
+
+    QBENCHMARK
+    {
+        lock->updateLock();
+    }
+}
+
+void
+QApplicationLockBench::requestLatency_data()
+{
+    addModes();
+}
+
+void
+QApplicationLockBench::requestLatency()
+{
+    //Time from isSecondaryInstance() in another process
+    //to instanceRequested() in this (primary) process
+    QFETCH(QString, mode);
+    QString name = uniqueName();
+
+    QScopedPointer<QApplicationLock> lock(createLock(name, mode));
+    QVERIFY(!lock->isSecondaryInstance());
+
+    qint64 signal_time = 0;
+    QEventLoop loop;
+    connect(lock.data(), &QApplicationLock::instanceRequested, [&]()
+    {
+        signal_time = steadyNanoseconds();
+        loop.quit();
+    });
+
+    qint64 total = 0;
+    for (int i = 0; i < m_request_iterations; i++)
+    {
+        signal_time = 0;
+        QProcess secondary;
+        secondary.start(QCoreApplication::applicationFilePath(), QStringList() << "--request" << mode << name);
+        QTimer::singleShot(10000, &loop, SLOT(quit()));
+        loop.exec();
+        QVERIFY(secondary.waitForFinished());
+        QVERIFY(signal_time);
+
+        qint64 request_time = secondary.readAllStandardOutput().trimmed().toLongLong();
+        QVERIFY(request_time);
+        total += signal_time - request_time;
+    }
+
+    QTest::setBenchmarkResult(total / m_request_iterations, QTest::WalltimeNanoseconds);
+}
+
+void
+QApplicationLockBench::readState_data()
+{
+    addModes();
+}
+
+void
+QApplicationLockBench::readState()
+{
+    //readPrimaryState() of a published state (1 KB)
+    QFETCH(QString, mode);
+
+    QScopedPointer<QApplicationLock> lock(createLock(uniqueName(), mode));
+    QVERIFY(!lock->isSecondaryInstance());
+    QVERIFY(lock->publishState(QByteArray(1024, 'x')));
+
+    QBENCHMARK
+    {
+        lock->readPrimaryState();
+    }
+}
+
+static int
+runChild(const QStringList &args)
+{
+    //--hold MODE NAME: primary instance, until stdin is closed (or killed)
+    //--request MODE NAME: secondary instance, prints time before request
+    //--tick MODE NAME COUNT: primary instance, runs COUNT heartbeat ticks
+    QString cmd = args.value(1);
+    if (cmd == "--tick" && args.value(2) == "file-baseline")
+    {
+        //Heartbeat tick of the file mode as it was written by path,
+        //before the open lock file was used (see updateLockSyscalls())
+        QTemporaryFile file;
+        if (!file.open()) return 1;
+        QString path = file.fileName();
+        for (int i = 0, count = args.value(4).toInt(); i < count; i++)
+        {
+            QFileInfo(path).lastModified();
+            qint64 ts_ms = QDateTime::currentMSecsSinceEpoch();
+            QApplicationLock::setFileTime(path, ts_ms / 1000, ts_ms);
+        }
+        return 0;
+    }
+
+    QScopedPointer<QApplicationLock> lock(QApplicationLockBench::createLock(args.value(3), args.value(2)));
+    if (cmd == "--hold")
+    {
+        if (lock->isSecondaryInstance()) return 1;
+        QSocketNotifier stdin_notifier(0, QSocketNotifier::Read);
+        QObject::connect(&stdin_notifier, SIGNAL(activated(int)), QCoreApplication::instance(), SLOT(quit()));
+        printf("ready\n");
+        fflush(stdout);
+        return QCoreApplication::exec();
+    }
+    else if (cmd == "--request")
+    {
+        printf("%lld\n", (long long)QApplicationLockBench::steadyNanoseconds());
+        fflush(stdout);
+        return lock->isSecondaryInstance() ? 0 : 1;
+    }
+    else if (cmd == "--tick")
+    {
+        if (lock->isSecondaryInstance()) return 1;
+        for (int i = 0, count = args.value(4).toInt(); i < count; i++)
+            lock->updateLock();
+        return 0;
+    }
+
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QString cmd = app.arguments().value(1);
+    if (cmd == "--hold" || cmd == "--request" || cmd == "--tick")
+        return runChild(app.arguments());
+
+    QApplicationLockBench bench;
+    return QTest::qExec(&bench, argc, argv);
+}
@@ -0,0 +1,128 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <chrono>
+#include <cstdio>
+
+#include <QtTest>
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QProcess>
+#include <QScopedPointer>
+#include <QSocketNotifier>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QTemporaryFile>
+
+#include "qapp-process-lock.hpp"
+
+/**
+ * Benchmarks for QApplicationLock, one row per lock mode:
+ * shmem (global), file (user), kernel (file + kernel lock),
+ * mapped (user, mapped file), socket.
+ *
+ * Times that can't be measured in a QBENCHMARK loop (because every
+ * iteration needs a fresh lock or another process) are measured
+ * manually and reported as walltime in ns.
+ *
+ * The request latency is measured across processes, this program
+ * is started again with --request to act as the secondary instance.
+ * A stale lock is left behind by a process started with --hold,
+ * which is killed, as after a crash.
+ * The syscalls of a heartbeat tick are counted with strace -c (Linux)
+ * in a process started with --tick, reported as events per tick.
+ */
+class QApplicationLockBench : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    static QApplicationLock*
+    createLock(const QString &name, const QString &mode);
+
+    static qint64
+    steadyNanoseconds();
+
+private slots:
+
+    void
+    decisionFresh_data();
+
+    void
+    decisionFresh();
+
+    void
+    decisionPrimary_data();
+
+    void
+    decisionPrimary();
+
+    void
+    decisionStale_data();
+
+    void
+    decisionStale();
+
+    void
+    updateLock_data();
+
+    void
+    updateLock();
+
+    void
+    updateLockBaseline();
+
+    void
+    updateLockSyscalls_data();
+
+    void
+    updateLockSyscalls();
+
+    void
+    writeFile();
+
+    void
+    requestLatency_data();
+
+    void
+    requestLatency();
+
+    void
+    readState_data();
+
+    void
+    readState();
+
+private:
+
+    static void
+    addModes(bool with_socket = true);
+
+    QString
+    uniqueName();
+
+    qint64
+    countSyscalls(const QString &strace, const QString &mode, int ticks);
+
+    int
+    m_counter = 0;
+
+    QMap<QString, qreal>
+    m_tick_syscalls; //per mode, see updateLockSyscalls()
+
+    static constexpr int
+    m_iterations = 100;
+
+    static constexpr int
+    m_request_iterations = 5;
+
+    static constexpr int
+    m_stale_iterations = 20;
+
+    static constexpr int
+    m_syscall_ticks = 1000;
+
+};
+
+#endif
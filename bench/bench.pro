@@ -0,0 +1,9 @@
+TARGET = qapp-process-lock-bench
+HEADERS = *.hpp
+SOURCES = *.cpp
+
+QT += testlib network
+
+QMAKE_CXXFLAGS += -std=c++11
+
+CONFIG += console
@@ -0,0 +1 @@
+../qapp-process-lock.cpp
\ No newline at end of file
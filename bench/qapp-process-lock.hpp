@@ -0,0 +1 @@
+../qapp-process-lock.hpp
\ No newline at end of file
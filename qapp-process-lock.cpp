@@ -1,5 +1,180 @@
 #include "qapp-process-lock.hpp"
 
+/**
+ * Layout of the shared memory segment (shmem mode).
+ * It's a fixed layout, nothing is serialized.
+ * The heartbeat is a single atomic field.
+ * The other fields are only written by the primary instance and
+ * protected by a sequence counter (seqlock), so readers never need
+ * the QSharedMemory semaphore. The request ring follows at m_msg_offset,
+ * the published state (StateArea) at m_state_offset.
+ */
+struct QApplicationLock::SharedSegment
+{
+    std::atomic<quint32> magic;
+    std::atomic<quint32> version;
+    std::atomic<quint32> seq; //odd while the primary instance is writing
+    std::atomic<quint32> ring_overflow; //requests coalesced (ring full)
+    std::atomic<quint64> ring_head; //next request, claimed by secondary instances
+    std::atomic<quint64> ring_tail; //next request to be read by the primary instance
+    std::atomic<qint64> interval; //heartbeat interval (ms)
+    std::atomic<qint64> ctime;
+    std::atomic<qint64> time; //heartbeat (wall clock, for display)
+    std::atomic<qint64> mono_time; //heartbeat (monotonicTimestamp()), for the age
+    std::atomic<qint64> pid;
+    std::atomic<qint64> start_time;
+    std::atomic<qint64> generation; //bumped by every acquisition (primary instance)
+    char title[128]; //UTF-8, protected by seq
+    std::atomic<quint64> instance_slots[m_max_slots]; //counting lock, see slotValue()
+    std::atomic<quint32> owner_state; //robust mode, owner mutex: 0 new, 1 ready
+#if defined(Q_OS_LINUX)
+    pthread_mutex_t owner; //robust mode, held by the primary instance
+#endif
+    //776 bytes (Linux x86_64), the request ring follows at m_msg_offset (4K)
+};
+
+/**
+ * Record of the request ring (shmem mode), m_ring_size of them.
+ * Record n (ring position) is at index n % m_ring_size, it's published
+ * by storing n + 1 in seq after the other fields have been written,
+ * so the primary instance can tell a new record from the previous one.
+ */
+struct QApplicationLock::RequestRecord
+{
+    std::atomic<quint64> seq;
+    std::atomic<qint64> pid;
+    std::atomic<qint64> time; //ms since epoch
+    std::atomic<quint32> size; //payload (serialized message), may be 0
+    char payload[m_msg_size];
+};
+
+/**
+ * State published by the primary instance (shmem mode), at m_state_offset.
+ * Only written by the primary instance, protected by its own sequence
+ * counter (seqlock), so reading it doesn't touch the segment header.
+ */
+struct QApplicationLock::StateArea
+{
+    std::atomic<quint32> seq; //odd while the primary instance is writing
+    std::atomic<quint32> size;
+    std::atomic<qint64> version; //bumped by every publishState()
+    char data[m_state_size];
+};
+
+//The atomics are shared between processes, so they must not be
+//emulated with a (process-local) lock
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+    "lock-free atomics required for the shared memory segment");
+
+#if !defined(Q_OS_WIN)
+static int
+openSegmentFile(const QByteArray &path, int flags, bool posix_shm)
+{
+    //Segment file (mapped file mode) or POSIX shared memory object
+#if defined(Q_OS_LINUX)
+    if (posix_shm) return shm_open(path.constData(), flags, 0600); //FD_CLOEXEC
+#else
+    Q_UNUSED(posix_shm);
+#endif
+    return ::open(path.constData(), flags | O_CLOEXEC, 0600);
+}
+#endif
+
+#if !defined(Q_OS_WIN)
+static bool
+lockRecordFile(int fd, bool *busy_ptr)
+{
+    //Exclusive lock on the lock file (OFD lock on Linux, flock() elsewhere),
+    //held by writers around the read-compare-write of the record,
+    //it's released when the file is closed
+    //It doesn't block (the caller may be the GUI thread), if another
+    //writer holds it, busy is set and the write is skipped like a conflict
+    *busy_ptr = false;
+    int rc = -1;
+#if defined(F_OFD_SETLK)
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    rc = fcntl(fd, F_OFD_SETLK, &fl);
+    if (rc == -1 && errno == EINVAL) //older kernel
+        rc = flock(fd, LOCK_EX | LOCK_NB);
+#else
+    rc = flock(fd, LOCK_EX | LOCK_NB);
+#endif
+    if (rc == 0) return true;
+    *busy_ptr = errno == EAGAIN || errno == EACCES || errno == EWOULDBLOCK;
+    return false;
+}
+#endif
+
+static bool
+isPrivateDir(const QString &path)
+{
+    //Message directory: a directory of our own (uid), only accessible by us
+    //(mode 0700), so other users can't read messages or inject them
+    //Not followed if it's a symlink
+#if !defined(Q_OS_WIN)
+    struct stat st;
+    return lstat(QFile::encodeName(path).constData(), &st) == 0 && S_ISDIR(st.st_mode) &&
+        st.st_uid == geteuid() && (st.st_mode & 07777) == 0700;
+#else
+    return QFileInfo(path).isDir();
+#endif
+}
+
+static bool
+createPrivateDir(const QString &path)
+{
+    //Create the directory (mode 0700) unless it exists,
+    //an existing one is only used if it's private (see isPrivateDir())
+#if !defined(Q_OS_WIN)
+    if (::mkdir(QFile::encodeName(path).constData(), 0700) != 0 && errno != EEXIST)
+        return false;
+#else
+    QDir().mkpath(path);
+#endif
+    return isPrivateDir(path);
+}
+
+static bool
+createExclusive(const QString &path)
+{
+    //Create a new file, fails if it exists (O_EXCL, also on NFS)
+#if QT_VERSION >= QT_VERSION_CHECK(5, 11, 0)
+    QFile file(path);
+    return file.open(QIODevice::WriteOnly | QIODevice::NewOnly);
+#elif !defined(Q_OS_WIN)
+    int fd = ::open(QFile::encodeName(path).constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd != -1) ::close(fd);
+    return fd != -1;
+#else
+    Q_UNUSED(path);
+    return false;
+#endif
+}
+
+//Slot of the counting lock, owner pid and heartbeat (s, monotonic) in one word,
+//so a slot is claimed (or taken over) with its heartbeat in a single CAS
+//0: free
+static quint64
+slotValue(qint64 pid, qint64 time)
+{
+    return ((quint64)(quint32)pid << 32) | (quint32)time;
+}
+
+static qint64
+slotPid(quint64 value)
+{
+    return (qint64)(value >> 32);
+}
+
+static qint64
+slotTime(quint64 value)
+{
+    return (qint64)(quint32)value;
+}
+
 qint64
 QApplicationLock::timestamp(bool milliseconds)
 {
@@ -19,6 +194,27 @@ QApplicationLock::timestamp(bool milliseconds)
     return current_time;
 }
 
+qint64
+QApplicationLock::monotonicTimestamp()
+{
+    //Milliseconds on a system-wide clock that isn't set (NTP, user)
+    //and doesn't advance while the system is suspended,
+    //so a heartbeat doesn't age across a clock step or a resume
+    qint64 current_time = 0;
+
+#if !defined(Q_OS_WIN)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        current_time = (qint64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    ULONGLONG unbiased_time = 0; //100 ns units, without sleep/hibernation
+    if (QueryUnbiasedInterruptTime(&unbiased_time))
+        current_time = unbiased_time / 10000;
+#endif
+
+    return current_time;
+}
+
 bool
 QApplicationLock::setFileTime(const QString &file_path, qint64 new_ts, qint64 new_ts_ms)
 {
@@ -70,6 +266,34 @@ QApplicationLock::setFileTime(const QString &file_path, qint64 new_ts, qint64 ne
     return ok;
 }
 
+qint64
+QApplicationLock::processStartTime(qint64 pid)
+{
+    qint64 start_time = 0;
+
+#if defined(Q_OS_LINUX)
+
+    //Field 22 of /proc/<pid>/stat, see ApplicationLock
+    start_time = ApplicationLock::processStartTime(pid);
+
+#elif defined(Q_OS_WIN) //Windows
+
+    HANDLE win_proc = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (win_proc)
+    {
+        FILETIME creation_time, exit_time, kernel_time, user_time;
+        if (GetProcessTimes(win_proc, &creation_time, &exit_time, &kernel_time, &user_time))
+        {
+            start_time = ((qint64)creation_time.dwHighDateTime << 32) | creation_time.dwLowDateTime;
+        }
+        CloseHandle(win_proc);
+    }
+
+#endif
+
+    return start_time;
+}
+
 QString
 QApplicationLock::getUsername()
 {
@@ -166,22 +390,249 @@ QApplicationLock::QApplicationLock(const QString &name, Scope scope, QObject *pa
     //or a local socket.
 
     //Determine scope and lock mode, prepare lock (lock won't be activated yet)
+    //Global is 0, so shmem mode is used unless the User flag is set
+    //A mapped file uses the shmem code (same segment), not on Windows
     m_scope = (int)scope;
-    if (scope == Scope::Undefined || (int)scope & (int)Scope::Global) m_use_shmem = true;
+#ifndef QT_NETWORK_LIB
+    if (scope != Scope::Undefined && (int)scope & (int)Scope::Socket)
+        throw std::invalid_argument("socket mode requires the Qt network module (QT += network)");
+#endif
+    if (scope != Scope::Undefined && (int)scope & (int)Scope::Socket) m_use_socket = true;
+#if !defined(Q_OS_WIN)
+    else if (scope != Scope::Undefined && (int)scope & (int)Scope::Mapped) m_use_shmem = m_use_mmap = true;
+#endif
+    else if (scope == Scope::Undefined || !((int)scope & (int)Scope::User)) m_use_shmem = true;
     else m_use_file = true;
     if (m_use_file) initFileName();
-    if (m_use_shmem) initShmemName();
+    if (m_use_shmem && !m_use_mmap) initShmemName();
+    if (m_use_mmap) initMappedName();
+    initSocketName(); //also used for reply sockets, see requestPrimary()
+
+    //Local socket, a connection from another instance is a request
+#ifdef QT_NETWORK_LIB
+    connect(&m_local_server, SIGNAL(newConnection()), SLOT(socketConnected()));
+#endif
 
     //Heartbeat timer
-    int update_interval = m_use_file ? 3000 : 1000;
-    m_tmr_check.setInterval(update_interval);
+    m_update_interval = m_use_file ? 3000 : 1000;
+    m_tmr_check.setInterval(m_update_interval.load());
     connect(&m_tmr_check, SIGNAL(timeout()), SLOT(updateLock()));
 
+    //Statistics, optionally reported periodically
+    qRegisterMetaType<QApplicationLock::Stats>("QApplicationLock::Stats");
+    qRegisterMetaType<QApplicationLock::Request>("QApplicationLock::Request");
+    connect(&m_tmr_stats, SIGNAL(timeout()), SLOT(reportStats()));
+
 }
 
 QApplicationLock::~QApplicationLock()
 {
+    stopStandby();
+    stopUpdateThread();
     if (isLockActive()) closeLock();
+    unmapFile();
+    unlockKernelFile();
+    if (m_registry) m_registry->remove(this);
+}
+
+void
+QApplicationLock::setKernelLockEnabled(bool enable)
+{
+    assert(!m_initialized); //must be set before the lock is initialized
+    m_use_kernel_lock = enable;
+}
+
+void
+QApplicationLock::setUpdateInterval(int msec)
+{
+    assert(msec > 0);
+    m_update_interval = msec;
+    m_tmr_check.setInterval(msec);
+    if (m_thread_timer)
+    {
+        QTimer *timer = m_thread_timer;
+        QTimer::singleShot(0, timer, [timer, msec]() { timer->setInterval(msec); });
+    }
+
+    //Publish new interval (only written by the primary instance)
+    if (m_active && m_use_shmem)
+        sharedSegment()->interval.store(msec, std::memory_order_relaxed);
+}
+
+int
+QApplicationLock::updateInterval() const
+{
+    return m_update_interval;
+}
+
+void
+QApplicationLock::setStaleTimeout(int msec)
+{
+    m_stale_timeout = msec;
+}
+
+int
+QApplicationLock::staleTimeout() const
+{
+    return m_stale_timeout;
+}
+
+void
+QApplicationLock::setMaxMissedHeartbeats(int count)
+{
+    m_max_missed = count;
+}
+
+int
+QApplicationLock::maxMissedHeartbeats() const
+{
+    return m_max_missed;
+}
+
+void
+QApplicationLock::setMaxInstances(int count)
+{
+    assert(!m_initialized); //must be set before the lock is initialized
+    assert(count > 0 && count <= m_max_slots);
+    m_max_instances = qBound(1, count, (int)m_max_slots);
+}
+
+int
+QApplicationLock::maxInstances() const
+{
+    return m_max_instances;
+}
+
+int
+QApplicationLock::instanceSlot() const
+{
+    return m_slot;
+}
+
+void
+QApplicationLock::setUpdateThreadEnabled(bool enable)
+{
+    assert(!m_initialized); //must be set before the lock is initialized
+    if (!enable)
+    {
+        stopUpdateThread();
+        return;
+    }
+    if (m_update_thread) return;
+
+    //The timer lives in the thread, updateLock() is called directly
+    //(in that thread), the signals are queued to their receivers
+    m_update_thread = new QThread(this);
+    m_thread_timer = new QTimer;
+    m_thread_timer->setInterval(m_update_interval.load());
+    m_thread_timer->moveToThread(m_update_thread);
+    connect(m_thread_timer, SIGNAL(timeout()), this, SLOT(updateLock()), Qt::DirectConnection);
+    connect(m_update_thread, SIGNAL(finished()), m_thread_timer, SLOT(deleteLater()));
+    m_update_thread->start();
+}
+
+bool
+QApplicationLock::isUpdateThreadEnabled() const
+{
+    return m_update_thread;
+}
+
+void
+QApplicationLock::setLeaseMode(const QString &dir, int lease_time)
+{
+    assert(!m_initialized); //must be set before the lock is initialized
+    assert(m_use_file && lease_time > 0);
+    m_lease_time = lease_time;
+    m_use_kernel_lock = false;
+    initFileName(dir);
+}
+
+bool
+QApplicationLock::isLeaseMode() const
+{
+    return m_lease_time > 0;
+}
+
+qint64
+QApplicationLock::fencingToken() const
+{
+    return m_active ? m_lease_token : 0;
+}
+
+QApplicationLock::Stats
+QApplicationLock::stats() const
+{
+    QMutexLocker locker(&m_stats_mutex);
+    Stats stats = m_stats;
+    if (stats.heartbeats > 1)
+        stats.heartbeat_jitter = m_stats_jitter_total / (stats.heartbeats - 1);
+    return stats;
+}
+
+void
+QApplicationLock::setStatsInterval(int msec)
+{
+    if (msec > 0)
+        m_tmr_stats.start(msec);
+    else
+        m_tmr_stats.stop();
+}
+
+void
+QApplicationLock::reportStats()
+{
+    emit statsUpdated(stats());
+}
+
+void
+QApplicationLock::countStat(qint64 Stats::*field, qint64 count)
+{
+    //Counters are updated by the update thread, if enabled
+    QMutexLocker locker(&m_stats_mutex);
+    m_stats.*field += count;
+}
+
+void
+QApplicationLock::recordHeartbeat()
+{
+    //Gap to the previous heartbeat and its deviation from the interval
+    QMutexLocker locker(&m_stats_mutex);
+    if (m_heartbeat_timer.isValid())
+    {
+        qint64 gap = m_heartbeat_timer.restart();
+        qint64 jitter = qAbs(gap - m_update_interval.load());
+        m_stats.heartbeat_max_gap = qMax(m_stats.heartbeat_max_gap, gap);
+        m_stats.heartbeat_max_jitter = qMax(m_stats.heartbeat_max_jitter, jitter);
+        m_stats_jitter_total += jitter;
+    }
+    else
+    {
+        m_heartbeat_timer.start();
+    }
+    m_stats.heartbeats++;
+}
+
+void
+QApplicationLock::recordRequest(qint64 count, qint64 request_time)
+{
+    //Latency from the time the request has been written (ms since epoch),
+    //if known (not in socket mode)
+    QMutexLocker locker(&m_stats_mutex);
+    m_stats.requests += count;
+    if (request_time > 0)
+    {
+        qint64 latency = qMax(timestamp(true) - request_time, (qint64)0);
+        m_stats.request_latency = latency;
+        m_stats.request_max_latency = qMax(m_stats.request_max_latency, latency);
+    }
+}
+
+void
+QApplicationLock::recordTakeover(qint64 age)
+{
+    QMutexLocker locker(&m_stats_mutex);
+    m_stats.takeovers++;
+    m_stats.takeover_age = age;
 }
 
 bool
@@ -201,127 +652,791 @@ QApplicationLock::isSecondaryInstance(qint64 *pid_ptr)
     return m_secondary;
 }
 
-void
-QApplicationLock::updateLock()
+bool
+QApplicationLock::acquire()
 {
+    return tryAcquireFor(std::chrono::milliseconds(-1));
+}
 
-    if (m_use_shmem)
-    {
-        //Read shmem segment
-        Segment seg = readSegment();
-
-        //Update heartbeat
-        seg.time = timestamp(true);
+bool
+QApplicationLock::tryAcquireFor(std::chrono::milliseconds timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
 
-        if (seg.request)
+    while (!m_active)
+    {
+        //Remaining time, the heartbeat check of the lock doesn't wait longer
+        qint64 remaining = -1;
+        if (timeout.count() >= 0)
+            remaining = qMax((qint64)timeout.count() - timer.elapsed(), (qint64)0);
+
+        //Try to acquire lock, without requesting the primary instance
+        m_initialized = false;
+        m_secondary = false;
+        initLockOnce(false, remaining);
+        if (m_active) break;
+        if (!m_secondary) return false; //error
+
+        //Wait for the primary instance to exit, then try again
+        //It's also checked again after a heartbeat interval,
+        //in case the lock has become stale while the process is running
+        if (timeout.count() >= 0)
         {
-            //Request signal received (flag was set)
-            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: request flag detected";
-            emit instanceRequested();
-            //Reset flag
-            seg.request = false;
+            remaining = (qint64)timeout.count() - timer.elapsed();
+            if (remaining <= 0) return false;
         }
-
-        //Write shmem segment
-        writeSegment(serializeSegment(seg));
+        waitForProcessExit(m_primary_pid, m_primary_start_time, remaining);
     }
-    else if (m_use_file)
-    {
-        //Check lock file timestamp from metadata
-        m_lock_file_info.refresh(); //discard cached timestamp!
-        QDateTime file_date = m_lock_file_info.lastModified().toUTC();
-        qint64 file_mtime = m_lock_file_info.lastModified().toUTC().toMSecsSinceEpoch();
 
-        //Re-read file only if timestamp differs from our last known timestamp
-        if (!m_lock_file_last_updated || file_mtime != m_lock_file_last_updated)
-        {
-            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: checking/reading lock";
-            bool ok = false;
-            Segment seg = readExistingLock(&ok, false); //false: don't close it
+    return true;
+}
 
-            if (ok && seg.request)
-            {
-                //Request signal received (flag was set)
-                QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: request flag detected";
-                emit instanceRequested();
-                //Reset flag
-                seg.request = false;
-                writeFile(serializeSegment(seg));
-            }
-        }
+bool
+QApplicationLock::startStandby()
+{
+    //Try to acquire the lock, without requesting the primary instance
+    initLockOnce(false);
+    if (m_active) return true;
+    if (!m_secondary) return false; //error
+    if (m_standby) return false;
+
+    //Only one standby instance at a time tries to take over
+    //The next one finds the new primary instance and waits for it
+    QString guard_filename = QDir::temp().filePath(QString(".%1.standby").arg(lockName()));
+    m_standby_guard.reset(new ApplicationLock(m_name.toStdString(), (int)ApplicationLock::User));
+    m_standby_guard->setLockFilePath(guard_filename.toLocal8Bit().constData());
+
+    //Wait on a thread, the GUI thread isn't blocked
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: standby, waiting for" << m_primary_pid;
+    m_standby = true;
+    m_standby_thread = new QThread(this);
+    m_standby_context = new QObject;
+    m_standby_context->moveToThread(m_standby_thread);
+    connect(m_standby_thread, SIGNAL(finished()), m_standby_context, SLOT(deleteLater()));
+    m_standby_thread->start();
+    waitForPrimary();
+    return false;
+}
 
-        //Update file timestamp
-        qint64 ts_ms = QDateTime::currentDateTimeUtc().toMSecsSinceEpoch(); //toSecsSinceEpoch() >= Qt 5.8
-        if (setFileTime(m_lock_file.fileName(), ts_ms / 1000, ts_ms))
-        {
-            m_lock_file_last_updated = ts_ms;
-            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: timestamp updated to" << ts_ms;
-        }
-        else
-        {
-            m_lock_file_last_updated = 0;
-        }
-    }
+void
+QApplicationLock::stopStandby()
+{
+    //Waits for the current wait (at most one heartbeat interval
+    //for the process and one for the guard file)
+    m_standby = false;
+    if (!m_standby_thread) return;
+    m_standby_thread->quit();
+    m_standby_thread->wait();
+    delete m_standby_thread;
+    m_standby_thread = 0;
+    m_standby_context = 0;
+    m_standby_guard.reset(); //unlocked
+}
 
+bool
+QApplicationLock::isStandby() const
+{
+    return m_standby;
 }
 
 void
-QApplicationLock::initShmemName()
+QApplicationLock::waitForPrimary()
 {
-    assert(!m_q_shmem.isAttached());
-
-    m_q_shmem.setKey(m_name);
+    //Wait for the primary process to exit (pidfd), but no longer than
+    //one heartbeat interval, then try to take over (GUI thread)
+    //The lock may also have become stale while the process is running
+    //The guard file is locked here as well, the GUI thread doesn't wait
+    //for it, it's unlocked after the takeover attempt
+    //The takeover is only attempted while holding the guard, so exactly
+    //one standby instance tries at a time, it's waited for as long as
+    //it takes (checking for stopStandby() after each interval)
+    //If it can't be locked at all (Windows, other user), there's no
+    //takeover, it's tried again after an interval
+    qint64 pid = m_primary_pid;
+    qint64 start_time = m_primary_start_time;
+    ApplicationLock *guard = m_standby_guard.data();
+    QTimer::singleShot(0, m_standby_context, [this, pid, start_time, guard]()
+    {
+        waitForProcessExit(pid, start_time, m_update_interval);
+        while (m_standby)
+        {
+            bool busy = false;
+            if (guard->tryLock(&busy) || (busy && guard->lock(m_update_interval)))
+            {
+                QMetaObject::invokeMethod(this, "promoteStandby", Qt::QueuedConnection);
+                return;
+            }
+            if (!busy)
+            {
+                QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: failed to lock standby guard file" << guard->lockFilePath().c_str();
+                QThread::msleep(m_update_interval);
+            }
+        }
+    });
 }
 
 void
-QApplicationLock::initFileName()
+QApplicationLock::promoteStandby()
 {
-    QString filename;
+    if (!m_standby) return;
 
-    //Get session properties
-    QString uid_str = getUsername();
-    QString sid_str = getSessionId(); //TODO extend for other platforms
+    //Takeover attempt while holding the guard (see waitForPrimary())
+    //Without waiting for a heartbeat, it's checked again with the next
+    //attempt (see waitForHeartbeat())
+    m_initialized = false;
+    m_secondary = false;
+    initLockOnce(false, 0);
+    m_standby_guard->unlock();
 
-    //Make lock name, unique for application + [user/session]
-    filename = "(QApplicationLock)";
-    filename += m_name;
-    if (m_scope & (int)Scope::User)
-        filename += QString("|%1").arg(uid_str);
-    else
-        throw std::invalid_argument("system-global scope not supported in file mode");
-    if (m_scope & (int)Scope::X11)
-        filename += QString("|%1").arg(sid_str);
+    if (m_active)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: standby promoted to primary instance";
+        stopStandby();
+        emit promotedToPrimary();
+        return;
+    }
+    if (!m_secondary)
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: standby failed to take over, trying again";
 
-    //Encode to avoid problematic characters ("/!\n") ending up in a filename
-    filename = filename.toUtf8().toBase64();
-    filename = QString(".%1.lck").arg(filename);
+    waitForPrimary();
+}
 
-    //Set lock file name, path
-    //If used in a Flatpak sandbox, consider adjusting lock_dir:
-    //If an application uses $TMPDIR to contain lock files you may want to add a wrapper script that sets it to $XDG_RUNTIME_DIR/app/$FLATPAK_ID (tmpfs) or /var/tmp (persistent on host).
-    //https://docs.flatpak.org/en/latest/sandbox-permissions.html
-    QString lock_dir = QDir::tempPath(); //env $TMPDIR or /tmp
-    m_lock_filename = filename;
-    assert(!m_lock_file.isOpen()); //init must run after ctor before locking
-    QString file_path = QDir(lock_dir).filePath(filename);
-    m_lock_file_info.setFile(file_path);
-    m_lock_file.setFileName(file_path);
+bool
+QApplicationLock::isSecondaryInstance(const QStringList &args, const QByteArray &payload, qint64 *pid_ptr)
+{
+    //Prepare message, forwarded if another instance is running
+    if (!m_initialized)
+        m_message = serializeMessage(args, payload);
+    return isSecondaryInstance(pid_ptr);
 }
 
 bool
-QApplicationLock::initLockOnce()
+QApplicationLock::requestPrimary(const QByteArray &payload, int timeout, QByteArray *reply_ptr)
 {
-    //When first called, this will try to initialize the lock,
-    //so it'll create it and start the timer that will check and update it.
-    //On success, this will be the primary instance.
-    //If an active lock is found, we'll abort without starting the timer
-    //because this would be a secondary instance then.
-    if (m_initialized) return false;
-    m_initialized = true;
+    if (reply_ptr) reply_ptr->clear();
+    if (m_initialized)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: lock already initialized, request not sent";
+        return false;
+    }
 
-    //Code from 2015, 9 years ago:
+#ifdef QT_NETWORK_LIB
+    //Listen for the reply before sending the request
+    //The name is short, the path length of a socket is limited
+    qint64 pid = QCoreApplication::applicationPid();
+    QString reply_name = QString(".qapplock-%1-%2.reply").arg(pid).arg(timestamp(true));
+#if !defined(Q_OS_WIN)
+    reply_name = QDir(QFileInfo(m_socket_name).path()).filePath(reply_name);
+#endif
+    QLocalServer reply_server;
+    if (m_scope & (int)Scope::User)
+        reply_server.setSocketOptions(QLocalServer::UserAccessOption);
+    else
+        reply_server.setSocketOptions(QLocalServer::WorldAccessOption);
+    if (!reply_server.listen(reply_name))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: failed to listen for reply" << reply_server.errorString();
+        return false;
+    }
 
-    //The shared memory segment contains a "request" flag (boolean),
+    //Send request (if another instance is running)
+    QElapsedTimer timer;
+    timer.start();
+    m_message = serializeMessage(QStringList(), payload, reply_server.fullServerName());
+    if (!isSecondaryInstance()) return false;
+
+    //Wait for the primary instance to connect and send the reply
+    //Blocking, there's no event loop needed
+    QLocalSocket *socket = 0;
+    QByteArray reply;
+    bool ok = false;
+    while (!ok)
+    {
+        int remaining = -1;
+        if (timeout >= 0)
+        {
+            remaining = timeout - timer.elapsed();
+            if (remaining <= 0) break;
+        }
+        if (!socket)
+        {
+            if (!reply_server.waitForNewConnection(remaining)) break;
+            socket = reply_server.nextPendingConnection();
+            continue;
+        }
+        QDataStream stream(socket);
+        stream.startTransaction();
+        stream >> reply;
+        ok = stream.commitTransaction();
+        if (!ok && !socket->waitForReadyRead(remaining)) break;
+    }
+
+    if (!ok)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: no reply from primary instance" << m_primary_pid << "within" << timeout;
+        return false;
+    }
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: reply received after" << timer.elapsed();
+    if (reply_ptr) *reply_ptr = reply;
+    return true;
+#else
+    Q_UNUSED(payload);
+    Q_UNUSED(timeout);
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: no Qt network module, request not sent";
+    return false;
+#endif
+}
+
+bool
+QApplicationLock::reply(const Request &request, const QByteArray &bytes)
+{
+    //Connect to the requesting instance, which is waiting for it
+    //If it has given up already, its socket is gone
+    if (request.reply_name.isEmpty()) return false;
+#ifdef QT_NETWORK_LIB
+    QLocalSocket socket;
+    socket.connectToServer(request.reply_name);
+    if (!socket.waitForConnected(m_socket_timeout))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: requesting instance gone, no reply sent" << request.pid;
+        return false;
+    }
+
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out << bytes;
+    socket.write(data);
+    bool ok = socket.waitForBytesWritten(m_socket_timeout);
+    socket.disconnectFromServer();
+
+    return ok;
+#else
+    Q_UNUSED(bytes);
+    return false;
+#endif
+}
+
+bool
+QApplicationLock::publishState(const QByteArray &state)
+{
+    //Primary instance only, it's the only writer
+    if (!m_active || m_max_instances > 1) return false;
+    if (state.size() > m_state_size)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: state too large" << state.size();
+        return false;
+    }
+
+    return writeState(state);
+}
+
+QByteArray
+QApplicationLock::readPrimaryState(qint64 *version_ptr)
+{
+    QByteArray state;
+    qint64 version = 0;
+
+    if (m_use_shmem)
+    {
+        //Attached only for this read (unless attached already),
+        //only the state is copied, not the segment
+        bool attached = isOpen();
+        if (attached || openExistingLock())
+        {
+            SharedSegment *shared = sharedSegment();
+            StateArea *area = stateArea();
+            bool valid = shared->magic.load(std::memory_order_relaxed) == m_seg_magic &&
+                shared->version.load(std::memory_order_relaxed) == m_seg_version;
+            for (int i = 0; valid && i < m_read_retries; i++)
+            {
+                quint32 seq = area->seq.load(std::memory_order_acquire);
+                if (i) countStat(&Stats::torn_reads);
+                if (seq & 1)
+                {
+                    QThread::yieldCurrentThread();
+                    continue;
+                }
+
+                quint32 size = qMin(area->size.load(std::memory_order_relaxed), (quint32)m_state_size);
+                state = QByteArray(area->data, size);
+                version = area->version.load(std::memory_order_relaxed);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (area->seq.load(std::memory_order_relaxed) == seq)
+                    break;
+                state.clear(); //torn read, try again
+                version = 0;
+            }
+            if (!attached) closeLock(true);
+        }
+    }
+    else if (!m_state_filename.isEmpty())
+    {
+        //The file is replaced atomically, it's never read half-written
+        QFile file(m_state_filename);
+        if (file.open(QIODevice::ReadOnly))
+        {
+            QDataStream stream(&file);
+            stream >> version >> state;
+            if (stream.status() != QDataStream::Ok)
+            {
+                state.clear();
+                version = 0;
+            }
+        }
+    }
+
+    if (version_ptr) *version_ptr = version;
+    return state;
+}
+
+bool
+QApplicationLock::writeState(const QByteArray &state)
+{
+    if (m_use_shmem)
+    {
+        //Seqlock writer, like writeSegment(), but with its own counter,
+        //so the heartbeat doesn't make a state reader retry
+        StateArea *area = stateArea();
+        if (!area) return false;
+        quint32 seq = area->seq.load(std::memory_order_relaxed);
+        area->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        memcpy(area->data, state.constData(), state.size());
+        area->size.store(state.size(), std::memory_order_relaxed);
+        area->version.fetch_add(1, std::memory_order_relaxed);
+
+        area->seq.store(seq + 2, std::memory_order_release);
+        return true;
+    }
+    else if (!m_state_filename.isEmpty())
+    {
+        //Written to a temporary file, then renamed, so a reader gets
+        //either the previous or the new state, without a lock
+        QSaveFile file(m_state_filename);
+        if (!file.open(QIODevice::WriteOnly)) return false;
+        QDataStream stream(&file);
+        stream << ++m_state_version << state;
+        return file.commit();
+    }
+
+    return false;
+}
+
+void
+QApplicationLock::clearState()
+{
+    //State of a previous primary instance (or ours, when closing)
+    if (m_use_shmem)
+        writeState(QByteArray());
+    else if (!m_state_filename.isEmpty())
+        QFile::remove(m_state_filename);
+}
+
+void
+QApplicationLock::updateLock()
+{
+    //Not the primary instance (anymore), nothing to update
+    if (!m_active) return;
+
+    if (m_use_shmem)
+    {
+        SharedSegment *shared = sharedSegment();
+        if (!shared) return;
+
+        //Counting lock, heartbeat of our slot
+        //Requests are handled by the instance in the first live slot,
+        //the others leave them in the ring (in case they move up)
+        if (m_max_instances > 1)
+        {
+            if (!updateSlot()) return; //lost
+            if (!isFirstLiveSlot()) return;
+        }
+
+        //Another instance has taken over (considered the lock stale),
+        //the segment isn't ours anymore, a single atomic load
+        if (m_max_instances == 1 && shared->generation.load(std::memory_order_acquire) != m_generation)
+        {
+            loseLock(shared->pid.load(std::memory_order_relaxed));
+            return;
+        }
+
+        //Update heartbeat, the wall clock time is only for display
+        shared->mono_time.store(monotonicTimestamp(), std::memory_order_relaxed);
+        shared->time.store(timestamp(true), std::memory_order_release);
+        if (m_max_instances == 1) recordHeartbeat();
+
+        //Handle all requests queued since the last update
+        drainRequests();
+    }
+    else if (m_use_file && m_lease_time > 0)
+    {
+        //Lease mode, the record is rewritten (renewed), including requests
+        renewLease();
+    }
+    else if (m_use_file)
+    {
+        //Check for a request (lock file modified by another process)
+        //This is normally picked up right away by the file watcher,
+        //checking it here as well covers platforms without a watcher
+        //It's also where a takeover by another instance is noticed
+        checkLockFile();
+        if (!m_active) return;
+
+        //No heartbeat needed while holding the kernel lock
+        if (m_kernel_lock && m_kernel_lock->isLocked()) return;
+
+        //Update file timestamp, on the open lock file (no path lookup)
+        //A request is noticed by the record's sequence number,
+        //not the mtime, so touching it can't hide one
+        qint64 ts_ms = QDateTime::currentDateTimeUtc().toMSecsSinceEpoch(); //toSecsSinceEpoch() >= Qt 5.8
+        if (touchLockFile(ts_ms))
+        {
+            recordHeartbeat();
+            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: timestamp updated to" << ts_ms;
+        }
+    }
+
+}
+
+void
+QApplicationLock::lockFileChanged(const QString &path)
+{
+    if (!m_active) return;
+
+    //If the watch has been dropped, the file has been replaced (renamed)
+    //by a secondary instance or removed, so the watched inode is gone
+    //In that case, the open file isn't the current one (its sequence number
+    //tells nothing), so it's re-read unconditionally and re-watched
+    bool replaced = !fileWatcher()->files().contains(path);
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: lock file changed" << (replaced ? "(replaced)" : "");
+    checkLockFile(replaced);
+    if (replaced) watchLockFile();
+}
+
+QApplicationLock::SharedSegment*
+QApplicationLock::sharedSegment() const
+{
+    //Shared memory segment, if attached
+    if (!m_use_shmem) return 0;
+    if (m_use_mmap) return static_cast<SharedSegment*>(m_mmap_data);
+    if (!m_q_shmem.isAttached()) return 0;
+    return static_cast<SharedSegment*>(const_cast<void*>(m_q_shmem.constData()));
+}
+
+QApplicationLock::RequestRecord*
+QApplicationLock::requestRecord(quint64 position) const
+{
+    //Record of the request ring, behind the segment header
+    static_assert(sizeof(SharedSegment) <= m_msg_offset &&
+        m_msg_offset + m_ring_size * sizeof(RequestRecord) <= m_seg_size,
+        "request ring doesn't fit into the shared memory segment");
+    char *area = (char*)sharedSegment() + m_msg_offset;
+    return reinterpret_cast<RequestRecord*>(area) + position % m_ring_size;
+}
+
+QApplicationLock::StateArea*
+QApplicationLock::stateArea() const
+{
+    //Published state, behind the request ring
+    static_assert(m_msg_offset + m_ring_size * sizeof(RequestRecord) <= m_state_offset &&
+        m_state_offset + sizeof(StateArea) <= m_seg_size,
+        "state area doesn't fit into the shared memory segment");
+    SharedSegment *shared = sharedSegment();
+    if (!shared) return 0;
+    return reinterpret_cast<StateArea*>((char*)shared + m_state_offset);
+}
+
+void
+QApplicationLock::initShmemName()
+{
+    assert(!m_q_shmem.isAttached());
+
+    m_q_shmem.setKey(m_name);
+}
+
+void
+QApplicationLock::initMappedName()
+{
+    //System-global: POSIX shared memory object with a robust owner mutex
+    //The name must not contain a slash (other than the leading one)
+    if (!(m_scope & (int)Scope::User))
+    {
+#if defined(Q_OS_LINUX)
+        m_use_robust = true;
+        m_mmap_filename = QString("/%1.shm").arg(lockName().replace("/", "_"));
+        return;
+#else
+        throw std::invalid_argument("system-global scope not supported in mapped file mode");
+#endif
+    }
+
+    //Segment file in the user's runtime directory (tmpfs, private),
+    //the temp directory if there's none
+    QString lock_dir = QProcessEnvironment::systemEnvironment().value("XDG_RUNTIME_DIR");
+    if (lock_dir.isEmpty()) lock_dir = QDir::tempPath();
+    m_mmap_filename = QDir(lock_dir).filePath(QString(".%1.shm").arg(lockName()));
+}
+
+bool
+QApplicationLock::mapFile(bool create, bool *created_ptr)
+{
+    //Map the segment file (mapped file mode), it's created if requested
+    //A new file is zero-filled, like a new shmem segment
+    //The fd isn't needed after mapping, the mapping keeps the file
+    bool created = false;
+    if (created_ptr) *created_ptr = false;
+
+#if !defined(Q_OS_WIN)
+
+    QByteArray path = m_mmap_filename.toLocal8Bit();
+    int fd = -1;
+    if (create)
+    {
+        fd = openSegmentFile(path, O_RDWR | O_CREAT | O_EXCL, m_use_robust);
+        created = fd != -1;
+    }
+    if (fd == -1)
+        fd = openSegmentFile(path, O_RDWR, m_use_robust);
+    if (fd == -1)
+    {
+        if (create) QAPP_PROCESS_LOCK_QDEBUG << "failed to create segment file" << m_mmap_filename;
+        return false;
+    }
+
+    //The size is set by the creator, the file might be just being created
+    //Extending it to the same size again doesn't change the contents
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size < m_seg_size && ftruncate(fd, m_seg_size) != 0))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to resize segment file" << m_mmap_filename;
+        ::close(fd);
+        return false;
+    }
+
+    void *data = mmap(0, m_seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to map segment file" << m_mmap_filename;
+        return false;
+    }
+
+    m_mmap_data = data;
+    m_mmap_ino = st.st_ino;
+    if (created_ptr) *created_ptr = created;
+    return true;
+
+#else
+
+    Q_UNUSED(create);
+    return false;
+
+#endif
+}
+
+void
+QApplicationLock::unmapFile()
+{
+    //The owner mutex must not stay locked without the mapping
+    //(the kernel couldn't mark it when this process dies)
+    unlockOwnerMutex();
+
+#if !defined(Q_OS_WIN)
+    if (m_mmap_data) munmap(m_mmap_data, m_seg_size);
+#endif
+    m_mmap_data = 0;
+}
+
+void
+QApplicationLock::socketConnected()
+{
+#ifdef QT_NETWORK_LIB
+    while (m_local_server.hasPendingConnections())
+    {
+        QLocalSocket *socket = m_local_server.nextPendingConnection();
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+        connect(socket, SIGNAL(readyRead()), SLOT(socketReadyRead()));
+
+        //Tell the secondary instance who we are
+        qint64 pid = QCoreApplication::applicationPid();
+        QByteArray bytes;
+        QDataStream stream(&bytes, QIODevice::WriteOnly);
+        stream << pid << processStartTime(pid);
+        socket->write(bytes);
+        socket->flush();
+
+        //The request (with optional message) follows right away
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: connection from other instance";
+    }
+#endif
+}
+
+void
+QApplicationLock::socketReadyRead()
+{
+#ifdef QT_NETWORK_LIB
+    QLocalSocket *socket = qobject_cast<QLocalSocket*>(sender());
+    if (!socket) return;
+
+    //Read request, wait for more data if it's incomplete
+    //R: request, P: probe (other instance waiting for the lock)
+    qint8 type = 0;
+    QByteArray bytes;
+    QDataStream stream(socket);
+    stream.startTransaction();
+    stream >> type >> bytes;
+    if (!stream.commitTransaction()) return;
+    disconnect(socket, SIGNAL(readyRead()), this, SLOT(socketReadyRead()));
+    if (type == 'P') return;
+
+    //Request received, the message may be empty
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: request received on socket";
+    recordRequest(1);
+    if (!bytes.isEmpty()) receiveMessage(bytes);
+    emit instanceRequested();
+#endif
+}
+
+void
+QApplicationLock::messageDirChanged()
+{
+    if (!m_active) return;
+
+    //Message file dropped by a secondary instance (or removed by us)
+    //The request flag is set right after it, that one emits the request
+    drainMessages();
+}
+
+QString
+QApplicationLock::lockName() const
+{
+    QString name;
+
+    //Get session properties
+    QString uid_str = getUsername();
+    QString sid_str = getSessionId(); //TODO extend for other platforms
+
+    //Make lock name, unique for application + [user/session]
+    name = "(QApplicationLock)";
+    name += m_name;
+    if (m_scope & (int)Scope::User)
+        name += QString("|%1").arg(uid_str);
+    if (m_scope & (int)Scope::X11)
+        name += QString("|%1").arg(sid_str);
+
+    //Encode to avoid problematic characters ("/!\n") ending up in a filename
+    name = name.toUtf8().toBase64();
+
+    return name;
+}
+
+void
+QApplicationLock::initFileName(const QString &dir)
+{
+    QString filename;
+
+    //Make lock name, unique for application + [user/session]
+    if (!(m_scope & (int)Scope::User))
+        throw std::invalid_argument("system-global scope not supported in file mode");
+    filename = QString(".%1.lck").arg(lockName());
+
+    //Set lock file name, path
+    //If used in a Flatpak sandbox, consider adjusting lock_dir:
+    //If an application uses $TMPDIR to contain lock files you may want to add a wrapper script that sets it to $XDG_RUNTIME_DIR/app/$FLATPAK_ID (tmpfs) or /var/tmp (persistent on host).
+    //https://docs.flatpak.org/en/latest/sandbox-permissions.html
+    //In lease mode, it's a shared directory
+    QString lock_dir = dir.isEmpty() ? QDir::tempPath() : dir; //env $TMPDIR or /tmp
+    m_lock_filename = filename;
+    assert(!m_lock_file.isOpen()); //init must run after ctor before locking
+    QString file_path = QDir(lock_dir).filePath(filename);
+    m_lock_file_info.setFile(file_path);
+    m_lock_file.setFileName(file_path);
+
+    //Guard file for the kernel lock (never removed)
+    //It's the lock file of ApplicationLock (same name), so a Qt-free tool
+    //can check for a running instance and vice versa
+    m_kernel_lock_filename = QDir(lock_dir).filePath(QString(".%1.flock").arg(lockName()));
+    m_kernel_lock.reset(new ApplicationLock(m_name.toStdString(), m_scope & ((int)Scope::User | (int)Scope::X11)));
+    m_kernel_lock->setLockFilePath(m_kernel_lock_filename.toLocal8Bit().constData());
+
+    //Message directory, created by the primary instance (private)
+    //In the user's runtime directory, if there's one, unless it's shared
+    //with secondary instances on other hosts (lease mode)
+    QString msg_dir = lock_dir;
+    QString runtime_dir = QProcessEnvironment::systemEnvironment().value("XDG_RUNTIME_DIR");
+    if (dir.isEmpty() && !runtime_dir.isEmpty())
+        msg_dir = runtime_dir;
+    m_msg_dir = QDir(msg_dir).filePath(QString(".%1.msg").arg(lockName()));
+
+    //State published by the primary instance
+    m_state_filename = QDir(lock_dir).filePath(QString(".%1.state").arg(lockName()));
+}
+
+void
+QApplicationLock::initSocketName()
+{
+    QString filename = QString(".%1.sock").arg(lockName());
+
+#if !defined(Q_OS_WIN)
+    //In user scope, the socket is placed in the user's runtime directory
+    //(private, tmpfs), a system-global socket must be in a shared location
+    //Note that the path length of a socket is limited (108 on Linux)
+    QString lock_dir = QDir::tempPath();
+    QString runtime_dir = QProcessEnvironment::systemEnvironment().value("XDG_RUNTIME_DIR");
+    if (m_scope & (int)Scope::User && !runtime_dir.isEmpty())
+        lock_dir = runtime_dir;
+    m_socket_name = QDir(lock_dir).filePath(filename);
+#else
+    //Named pipe, no directory
+    QString lock_dir = QDir::tempPath();
+    m_socket_name = filename;
+#endif
+
+    //Guard file for the kernel lock, next to the socket, see initSocketLock()
+    m_socket_guard_filename = QDir(lock_dir).filePath(filename + ".guard");
+
+    //State published by the primary instance, next to the socket
+    if (m_use_socket)
+        m_state_filename = QDir(lock_dir).filePath(QString(".%1.state").arg(lockName()));
+
+    //Other users must be able to connect to a system-global socket
+#ifdef QT_NETWORK_LIB
+    if (m_scope & (int)Scope::User)
+        m_local_server.setSocketOptions(QLocalServer::UserAccessOption);
+    else
+        m_local_server.setSocketOptions(QLocalServer::WorldAccessOption);
+#endif
+}
+
+bool
+QApplicationLock::initLockOnce(bool send_request, qint64 heartbeat_timeout)
+{
+    //When first called, this will try to initialize the lock,
+    //so it'll create it and start the timer that will check and update it.
+    //On success, this will be the primary instance.
+    //If an active lock is found, we'll abort without starting the timer
+    //because this would be a secondary instance then.
+    //A lock file that looks stale while its owner is still running is
+    //only taken over if its heartbeat doesn't move, the wait for that is
+    //limited to heartbeat_timeout (ms, -1: no limit), see waitForHeartbeat()
+    if (m_initialized) return false;
+    m_initialized = true;
+
+    //Socket mode works without lock segment and heartbeat
+    if (m_use_socket) return initSocketLock(send_request);
+
+    //Counting lock, one of several slots
+    if (m_max_instances > 1) return initSlotLock(send_request);
+
+    //Robust owner mutex, no heartbeat needed to detect a dead primary
+    if (m_use_robust) return initRobustLock(send_request);
+
+    //Code from 2015, 9 years ago:
+
+    //The shared memory segment contains a "request" flag (boolean),
     //which is used by a second instance to tell the first instance
     //to show up. The first instance will check this flag periodically.
     //If a shared memory segment is found, another instance is probably
@@ -337,20 +1452,60 @@ QApplicationLock::initLockOnce()
     //in which case the user should restart the program after < timeout sec.
     //In shmem mode, we could detect this by merely calling openExistingLock()
     //again and if that fails, the leftover was automatically cleaned up.
-    //Checking the process using kill would only be possible in user mode.
+    //The owner process is checked as well (pid and start time).
+    //With a kernel lock (file mode), the kernel tells us right away:
+    //If we've got it, any existing lock file is a leftover,
+    //if another process holds it, the primary instance is alive.
+    //If it's not available, the heartbeat check is used.
+    //Without the kernel lock, the guard file is only checked (and released
+    //right away), a Qt-free ApplicationLock holds it but has no lock file.
+    int kernel_lock = -1;
+    if (m_use_file && !m_lease_time)
+    {
+        kernel_lock = lockKernelFile();
+        if (kernel_lock == 1 && !m_use_kernel_lock)
+        {
+            unlockKernelFile();
+            kernel_lock = -1;
+        }
+    }
+
     bool found_lock = false;
     Segment seg = readExistingLock(&found_lock);
-    if (found_lock)
+    if (found_lock || kernel_lock == 0)
     {
-        int timeout = 15;
-        qint64 age = lockAge(seg) / 1000;
+        //No lock file (yet), the owner is recorded in the guard file
+        //Without the kernel lock, the lock file may be a leftover
+        if (kernel_lock == 0 && (!found_lock || !m_use_kernel_lock))
+        {
+            long long start_time = 0;
+            seg.pid = m_kernel_lock->ownerPid(&start_time);
+            seg.start_time = start_time;
+        }
+
+        qint64 timeout = staleAge(seg);
+        qint64 age = lockAge(seg);
         bool is_proc_gone = isProcessGone(seg);
+        bool is_stale = age > timeout || is_proc_gone;
+        //In file mode, the heartbeat is the file's mtime (wall clock),
+        //after a clock step or a resume, a live lock may look old,
+        //so it's only taken over if the heartbeat doesn't move
+        //The owner process is still running (or unknown) in that case
+        //In lease mode, only the end of the lease counts (and the owner
+        //process, if it's on this host), not the age of the file
+        if (kernel_lock != -1)
+            is_stale = kernel_lock == 1;
+        else if (m_lease_time > 0)
+            is_stale = seg.expiry < timestamp(true) || is_proc_gone;
+        else if (is_stale && !is_proc_gone && m_use_file && found_lock)
+            is_stale = !waitForHeartbeat(seg, heartbeat_timeout);
 
         //Check if lock is old or active
-        if (age > timeout || is_proc_gone)
+        if (is_stale)
         {
             //Too old, it's a leftover
-            QAPP_PROCESS_LOCK_QDEBUG << "Found old process lock, discarding" << "age:" << age << "process gone:" << is_proc_gone;
+            QAPP_PROCESS_LOCK_QDEBUG << "Found old process lock, discarding" << "age:" << age << "process gone:" << is_proc_gone << "kernel lock:" << kernel_lock;
+            if (found_lock) recordTakeover(age);
 
             //Detach, ignore dead leftover
             closeLock(); //delete lock
@@ -365,16 +1520,11 @@ QApplicationLock::initLockOnce()
             QAPP_PROCESS_LOCK_QDEBUG << "heartbeat age:" << age << "pid:" << seg.pid;
             m_secondary = true;
 
-            //Request first instance (set show flag)
-            seg.request = true;
-            if (openExistingLock(true)) //open for writing
-                writeLock(seg);
+            //Request first instance, along with the message (if any)
+            if (send_request && openExistingLock(true)) //open for writing
+                sendRequest();
             //else reattaching failed, ignore that error
 
-            //Only this flag is changed from false to true!
-            //The size of the whole segment does not change!
-            //So no need to worry about overflowing.
-
             //Explicitly detach (just to make it obvious that we're done)
             //Detach/close lock (without removing it)
             closeLock(true); //detach, in file mode close without removing it
@@ -382,22 +1532,46 @@ QApplicationLock::initLockOnce()
             //Prevent this instance from breaking config
             //dont_touch_config = true; //was that a good idea?
             m_primary_pid = seg.pid;
-            emit otherInstanceDetected(seg.pid);
+            m_primary_start_time = seg.start_time;
+            if (send_request) emit otherInstanceDetected(seg.pid);
 
             //Terminate
             return false;
         }
     }
 
+    //Lease mode, claim the next fencing token
+    //If several instances take over at the same time, only one gets it
+    if (m_lease_time > 0 && !claimLease(found_lock ? seg : Segment{}, found_lock))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "Another instance has taken the lease";
+        m_secondary = true;
+        m_primary_pid = 0;
+        m_primary_start_time = 0;
+        if (send_request) emit otherInstanceDetected(0);
+        return false;
+    }
+
     //Set primary instance flag
     m_active = true;
 
     //Write segment with lock info
+    //The generation follows the one of a lock that's been taken over
+    qint64 generation = seg.generation + 1;
     seg = Segment{};
     seg.ctime = timestamp(true); //creation time
     //seg.time = 0 //heartbeat updated by timer routine
     seg.pid = QCoreApplication::applicationPid();
     seg.request = false;
+    seg.interval = m_update_interval;
+    seg.start_time = processStartTime(seg.pid);
+    seg.hostname = QSysInfo::machineHostName();
+    seg.generation = generation;
+    if (m_lease_time > 0)
+    {
+        seg.expiry = seg.ctime + m_lease_time;
+        seg.token = m_lease_token;
+    }
     //Write, create lock
     if (!createLock(seg))
     {
@@ -407,69 +1581,1025 @@ QApplicationLock::initLockOnce()
     QAPP_PROCESS_LOCK_QDEBUG << "process lock created";
 
     //Start update timer
-    m_tmr_check.start();
-    updateLock();
-
+    //While holding the kernel lock, there's no heartbeat to write,
+    //the timer is only started if the lock file can't be watched
+    //With the update thread, it's always polled
+    if (kernel_lock != 1 || m_update_thread) startUpdateTimer();
+    triggerUpdate();
+
+    //Watch lock file for requests, message directory (file mode)
+    //In lease mode, requests are handled when the lease is renewed
+    //(a watcher wouldn't see changes made on another host anyway)
+    if (m_use_file && !m_update_thread)
+    {
+        if (!m_lease_time) watchLockFile();
+        if (isPrivateDir(m_msg_dir)) fileWatcher()->addPath(m_msg_dir);
+    }
+
     return true;
 }
 
 bool
-QApplicationLock::isProcessGone(const Segment &segment)
+QApplicationLock::initSocketLock(bool send_request)
 {
-    //Try to check if the primary process is still running
-    //This is not always possible
-    //We're checking the process itself in user mode (other user => no perms)
-
-    //true if process gone, false in doubt
-    if (m_scope & (int)Scope::User)
+    //Connect to the primary instance, if there is one
+    //A successful connection means that it's alive and it's also the request,
+    //the primary instance will emit its signal when accepting it.
+    //If the primary has crashed, the socket file may still exist
+    //but the connection is refused, so there's no timeout to wait for.
+    //Removing a leftover socket and listening is done while holding
+    //a kernel lock on a guard file, so two instances that have both been
+    //refused can't both take over (the second one would remove the socket
+    //of the first one). The second one connects again after getting it.
+    //If the guard file can't be locked (Windows, other user), it's tried
+    //anyway, like before.
+#ifdef QT_NETWORK_LIB
+    ApplicationLock guard(m_name.toStdString(), (int)ApplicationLock::User);
+    guard.setLockFilePath(m_socket_guard_filename.toLocal8Bit().constData());
+    for (int attempt = 0; attempt < 2; attempt++)
     {
-        QAPP_PROCESS_LOCK_QDEBUG << "trying to check if process is gone" << segment.pid;
+        QLocalSocket socket;
+        socket.connectToServer(m_socket_name);
+        if (socket.waitForConnected(m_socket_timeout))
+        {
+            //Other instance is running
+            QAPP_PROCESS_LOCK_QDEBUG << "Another instance is already running";
+            m_secondary = true;
 
-#if defined(Q_OS_UNIX) //Linux
+            //Send request, along with the message (may be empty)
+            QByteArray bytes;
+            QDataStream out(&bytes, QIODevice::WriteOnly);
+            out << (qint8)(send_request ? 'R' : 'P') << m_message;
+            socket.write(bytes);
+            socket.waitForBytesWritten(m_socket_timeout);
+
+            //The primary instance sends its pid when accepting the connection
+            qint64 pid = 0;
+            qint64 start_time = 0;
+            if (socket.waitForReadyRead(m_socket_timeout))
+            {
+                QDataStream stream(&socket);
+                stream >> pid >> start_time;
+            }
+            socket.disconnectFromServer();
+
+            m_primary_pid = pid;
+            m_primary_start_time = start_time;
+            if (send_request) emit otherInstanceDetected(pid);
+            return false;
+        }
+        QAPP_PROCESS_LOCK_QDEBUG << "no instance listening on" << m_socket_name << socket.errorString();
 
-        //In user mode, a 0 signal to the primary process is used
-        //to determine if it's still running
-        //(ignoring another process with the same pid)
-        if (kill(segment.pid, 0) != 0)
+        //Take the guard, then connect again, another instance may have
+        //started listening in the meantime
+        if (!attempt)
         {
-            QAPP_PROCESS_LOCK_QDEBUG << "pid is gone" << segment.pid;
-            //No such process anymore
+            if (!guard.lock(m_socket_timeout))
+                QAPP_PROCESS_LOCK_QDEBUG << "failed to lock socket guard file" << m_socket_guard_filename;
+            continue;
+        }
+
+        //Socket file exists but our connection was refused again,
+        //so it's a leftover from a crashed primary, remove it
+        //Listening before the guard is released (destructor)
+        QLocalServer::removeServer(m_socket_name);
+
+        //Listen, this will be the primary instance
+        if (m_local_server.listen(m_socket_name))
+        {
+            m_active = true;
+            clearState(); //leftover from a crashed primary
+            QAPP_PROCESS_LOCK_QDEBUG << "process lock created" << m_local_server.fullServerName();
             return true;
         }
+    }
 
-#elif defined(Q_OS_WIN) //Windows
+    QAPP_PROCESS_LOCK_QDEBUG << "failed to create process lock" << m_local_server.errorString();
+#else
+    Q_UNUSED(send_request); //socket mode is refused by the constructor
+#endif
+    return false;
+}
+
+bool
+QApplicationLock::initSlotLock(bool send_request)
+{
+    //Claim one of m_max_instances slots, this instance is secondary
+    //only if all of them are held by live instances
+    qint64 pid = 0;
+    if (m_use_shmem)
+    {
+        //Attach to the slot table or create it (zero-filled, all slots free)
+        //The table is never reset, other instances may claim slots
+        //before the creator has written the header
+        if (!openExistingLock(true))
+        {
+            bool created = false;
+            if (m_use_mmap)
+                mapFile(true, &created);
+            else
+                created = m_q_shmem.create(m_seg_size);
+            if (created)
+            {
+                Segment seg{};
+                seg.ctime = timestamp(true);
+                seg.pid = QCoreApplication::applicationPid();
+                seg.interval = m_update_interval;
+                seg.start_time = processStartTime(seg.pid);
+                writeLock(seg);
+            }
+            else if (!isOpen() && !openExistingLock(true)) //created by another instance
+            {
+                QAPP_PROCESS_LOCK_QDEBUG << "failed to create process lock" << m_q_shmem.errorString();
+                return false;
+            }
+        }
 
-        HANDLE win_proc = OpenProcess(SYNCHRONIZE, FALSE, segment.pid);
-        if (!win_proc)
+        m_slot = claimSlot();
+        if (m_slot != -1)
         {
+            m_active = true;
+            QAPP_PROCESS_LOCK_QDEBUG << "process lock slot claimed" << m_slot;
+            startUpdateTimer();
+            triggerUpdate();
             return true;
         }
-        else
+
+        //All slots taken, request the instance in the first slot
+        pid = slotPid(sharedSegment()->instance_slots[0].load(std::memory_order_acquire));
+        if (send_request) sendRequest();
+        closeLock(true); //detach
+    }
+    else if (m_use_file)
+    {
+        //Kernel lock on one guard file per slot, released on exit
+        for (int i = 0; i < m_max_instances; i++)
         {
-            DWORD ret = WaitForSingleObject(win_proc, 0);
-            CloseHandle(win_proc);
-            if (ret != WAIT_TIMEOUT)
+            m_kernel_lock->setLockFilePath(slotFileName(i).toLocal8Bit().constData());
+            bool busy = false;
+            if (m_kernel_lock->tryLock(&busy))
+            {
+                m_active = true;
+                m_slot = i;
+                QAPP_PROCESS_LOCK_QDEBUG << "process lock slot claimed" << m_slot;
                 return true;
+            }
+            if (!busy)
+            {
+                QAPP_PROCESS_LOCK_QDEBUG << "failed to create process lock" << slotFileName(i);
+                return false;
+            }
+            if (!pid) pid = m_kernel_lock->ownerPid();
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    QAPP_PROCESS_LOCK_QDEBUG << "All instance slots are taken" << m_max_instances;
+    m_secondary = true;
+    m_primary_pid = pid;
+    m_primary_start_time = 0;
+    if (send_request) emit otherInstanceDetected(pid);
+    return false;
+}
+
+bool
+QApplicationLock::initRobustLock(bool send_request)
+{
+    //The primary instance holds the robust owner mutex in the segment
+    //If it dies, the kernel marks the mutex and the next instance that
+    //tries to lock it gets EOWNERDEAD right away, so the heartbeat
+    //(still written for display) is not needed to detect that
+    //The segment stays mapped as long as the mutex is held
+    //An object that can't be used (its creator has died before
+    //initializing the mutex, or another layout version) is removed
+    //and created again, otherwise it would stay in /dev/shm until reboot
+    bool ready = false;
+    for (int attempt = 0; attempt < 2 && !ready; attempt++)
+    {
+        bool created = false;
+        if (!mapFile(true, &created)) break;
+        ready = initOwnerMutex(created);
+        if (!ready)
+        {
+            removeBrokenObject();
+            unmapFile();
+        }
+    }
+    if (!ready)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to create process lock" << m_mmap_filename;
+        unmapFile();
+        return false;
+    }
+
+#if defined(Q_OS_LINUX)
+    SharedSegment *shared = sharedSegment();
+    int rc = pthread_mutex_trylock(&shared->owner);
+    if (rc == EOWNERDEAD)
+    {
+        //Previous primary instance has died, take over its segment
+        bool ok = false;
+        Segment seg = readSegment(&ok);
+        QAPP_PROCESS_LOCK_QDEBUG << "Found old process lock, owner died" << seg.pid;
+        pthread_mutex_consistent(&shared->owner);
+        if (ok) recordTakeover(lockAge(seg));
+        rc = 0;
+    }
+    if (rc == 0)
+    {
+        m_owner_locked = true;
+        m_active = true;
+        Segment seg{};
+        seg.ctime = timestamp(true);
+        seg.pid = QCoreApplication::applicationPid();
+        seg.interval = m_update_interval;
+        seg.start_time = processStartTime(seg.pid);
+        if (!createLock(seg))
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "failed to create process lock";
+            m_active = false;
+            unmapFile();
+            return false;
+        }
+        QAPP_PROCESS_LOCK_QDEBUG << "process lock created (owner mutex)";
+
+        //The timer drains the request ring
+        startUpdateTimer();
+        triggerUpdate();
+        return true;
+    }
+    if (rc == EBUSY)
+    {
+        //Held by the primary instance, it's alive
+        bool ok = false;
+        Segment seg = readSegment(&ok);
+        QAPP_PROCESS_LOCK_QDEBUG << "Another instance is already running" << "pid:" << seg.pid;
+        m_secondary = true;
+        if (send_request) sendRequest();
+        unmapFile();
+        m_primary_pid = seg.pid;
+        m_primary_start_time = seg.start_time;
+        if (send_request) emit otherInstanceDetected(seg.pid);
+        return false;
+    }
+    QAPP_PROCESS_LOCK_QDEBUG << "failed to lock owner mutex" << rc;
+#else
+    Q_UNUSED(send_request);
+#endif
+
+    unmapFile();
+    return false;
+}
+
+bool
+QApplicationLock::initOwnerMutex(bool created)
+{
+    //The creator of the segment initializes the owner mutex,
+    //other instances wait until it's ready (a new segment is zero-filled)
+    //The mutex is robust (EOWNERDEAD) and shared between processes
+    SharedSegment *shared = sharedSegment();
+    if (!shared) return false;
+
+#if defined(Q_OS_LINUX)
+    if (created)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        int rc = pthread_mutex_init(&shared->owner, &attr);
+        pthread_mutexattr_destroy(&attr);
+        if (rc != 0) return false;
+        //The layout is published before the mutex is marked ready,
+        //see ownerMutexState()
+        shared->version.store(m_seg_version, std::memory_order_relaxed);
+        shared->magic.store(m_seg_magic, std::memory_order_release);
+        shared->owner_state.store(1, std::memory_order_release);
+        return true;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    int state = 0;
+    while ((state = ownerMutexState()) == 0)
+    {
+        if (timer.hasExpired(m_socket_timeout))
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "owner mutex not initialized" << m_mmap_filename;
+            return false;
         }
+        QThread::yieldCurrentThread();
+    }
+    if (state == -1)
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to read process lock, unknown layout" << m_mmap_filename;
+    return state == 1;
+#else
+    Q_UNUSED(created);
+    return false;
+#endif
+}
+
+int
+QApplicationLock::ownerMutexState() const
+{
+    //1: owner mutex ready, 0: not yet, -1: unknown layout
+    //The magic and version are at the same offsets in every layout,
+    //the owner mutex may not be (an object of another version of this
+    //module), so it's only used if they match
+    const SharedSegment *shared = sharedSegment();
+    if (!shared) return -1;
+    quint32 magic = shared->magic.load(std::memory_order_acquire);
+    if (!magic) return 0;
+    if (magic != m_seg_magic || shared->version.load(std::memory_order_relaxed) != m_seg_version)
+        return -1;
+    return shared->owner_state.load(std::memory_order_acquire) == 1 ? 1 : 0;
+}
 
+void
+QApplicationLock::removeBrokenObject()
+{
+    //Remove the shared memory object that we've mapped (robust mode),
+    //so that the next attempt creates a new one
+    //Instances that find it broken at the same time serialize on a lock
+    //on the object itself, only the first one removes it, the others find
+    //that the name refers to a new object already (other inode)
+    //It's checked again while holding that lock, a slow creator may have
+    //initialized it in the meantime
+#if defined(Q_OS_LINUX)
+    QByteArray path = m_mmap_filename.toLocal8Bit();
+    int fd = openSegmentFile(path, O_RDWR, true);
+    if (fd == -1) return; //removed already
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (quint64)st.st_ino == m_mmap_ino && flock(fd, LOCK_EX) == 0)
+    {
+        int current_fd = openSegmentFile(path, O_RDWR, true);
+        struct stat current_st;
+        bool same = current_fd != -1 && fstat(current_fd, &current_st) == 0 && current_st.st_ino == st.st_ino;
+        if (current_fd != -1) ::close(current_fd);
+        if (same && ownerMutexState() != 1)
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "removing broken shared memory object" << m_mmap_filename;
+            shm_unlink(path.constData());
+        }
+    }
+    ::close(fd); //releases the lock
 #endif
+}
+
+void
+QApplicationLock::unlockOwnerMutex()
+{
+    //Release the owner mutex (primary instance), the next instance
+    //can lock it without EOWNERDEAD
+    //It must be unlocked by the thread that has locked it
+    if (!m_owner_locked) return;
+    m_owner_locked = false;
+#if defined(Q_OS_LINUX)
+    SharedSegment *shared = sharedSegment();
+    if (shared && pthread_mutex_unlock(&shared->owner) != 0)
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to unlock owner mutex (other thread?)";
+#endif
+}
+
+void
+QApplicationLock::startUpdateTimer()
+{
+    //Heartbeat timer, the registry (if any) updates all its locks at once
+    if (m_update_thread)
+        QMetaObject::invokeMethod(m_thread_timer, "start"); //in its thread
+    else if (m_registry)
+        m_registry->scheduleUpdates(this);
+    else if (!m_tmr_check.isActive())
+        m_tmr_check.start();
+}
+
+void
+QApplicationLock::triggerUpdate()
+{
+    //Update now, on the update thread if there is one
+    if (m_update_thread)
+        QTimer::singleShot(0, m_thread_timer, [this]() { updateLock(); });
+    else
+        updateLock();
+}
+
+void
+QApplicationLock::stopUpdateThread()
+{
+    //The timer is deleted in its thread when it finishes
+    if (!m_update_thread) return;
+    m_update_thread->quit();
+    m_update_thread->wait();
+    delete m_update_thread;
+    m_update_thread = 0;
+    m_thread_timer = 0;
+}
+
+QString
+QApplicationLock::slotFileName(int slot) const
+{
+    //Guard file of a slot (file mode), next to the lock file
+    return QDir(QFileInfo(m_kernel_lock_filename).path()).filePath(QString(".%1.%2.flock").arg(lockName()).arg(slot));
+}
+
+int
+QApplicationLock::claimSlot()
+{
+    //Claim a free or stale slot, only one instance wins each CAS
+    //If the slot has changed in the meantime, the next one is tried
+    SharedSegment *shared = sharedSegment();
+    if (!shared) return -1;
+    quint64 own_value = slotValue(QCoreApplication::applicationPid(), monotonicTimestamp() / 1000);
+    for (int i = 0; i < m_max_instances; i++)
+    {
+        quint64 value = shared->instance_slots[i].load(std::memory_order_acquire);
+        if (value && !isSlotStale(value)) continue;
+        if (value) QAPP_PROCESS_LOCK_QDEBUG << "taking over stale slot" << i << slotPid(value);
+        quint64 old_value = value;
+        if (shared->instance_slots[i].compare_exchange_strong(value, own_value, std::memory_order_acq_rel))
+        {
+            if (old_value) recordTakeover((monotonicTimestamp() / 1000 - slotTime(old_value)) * 1000);
+            return i;
+        }
+    }
+
+    return -1;
+}
 
-        //The primary process is running (or, in case of an error, another one)
-        //Ideally use another identifier like the process name to double-check
-        //(that it's not a new process with the same pid after primary crashed)
-        //uptime might be better because process name can change
+bool
+QApplicationLock::updateSlot()
+{
+    //Heartbeat of our slot, as long as we still own it
+    //It's gone if another instance considered it stale (e.g., this process
+    //has been suspended), then we try to claim another one
+    SharedSegment *shared = sharedSegment();
+    if (!shared || m_slot == -1) return false;
+    qint64 pid = QCoreApplication::applicationPid();
+    quint64 value = shared->instance_slots[m_slot].load(std::memory_order_relaxed);
+    while (slotPid(value) == pid)
+    {
+        if (shared->instance_slots[m_slot].compare_exchange_weak(value, slotValue(pid, monotonicTimestamp() / 1000), std::memory_order_acq_rel))
+        {
+            recordHeartbeat();
+            return true;
+        }
+    }
+
+    QAPP_PROCESS_LOCK_QDEBUG << "slot has been taken over" << m_slot << slotPid(value);
+    m_slot = claimSlot();
+    if (m_slot != -1) return true;
+
+    //No other slot free, this instance isn't one of the allowed ones anymore
+    loseLock(slotPid(value));
+    return false;
+}
+
+void
+QApplicationLock::releaseSlot()
+{
+    //Free our slot (only if we still own it)
+    if (m_slot == -1) return;
+    if (SharedSegment *shared = sharedSegment())
+    {
+        quint64 value = shared->instance_slots[m_slot].load(std::memory_order_relaxed);
+        if (slotPid(value) == QCoreApplication::applicationPid())
+            shared->instance_slots[m_slot].compare_exchange_strong(value, 0, std::memory_order_acq_rel);
+    }
+    else if (m_use_file)
+    {
+        unlockKernelFile();
+    }
+    m_slot = -1;
+}
+
+bool
+QApplicationLock::isSlotStale(quint64 value)
+{
+    //Like the lock, stale if the heartbeat is overdue or the owner is gone
+    //The heartbeat has a resolution of 1 s, the start time isn't known
+    //(it's not in the slot, so it can't be compared)
+    Segment seg{};
+    seg.pid = slotPid(value);
+    qint64 age = (monotonicTimestamp() / 1000 - slotTime(value)) * 1000;
+    return age > staleAge(seg) + 1000 || isProcessGone(seg);
+}
+
+bool
+QApplicationLock::isFirstLiveSlot()
+{
+    //True if all slots before ours are free or stale
+    SharedSegment *shared = sharedSegment();
+    if (!shared || m_slot == -1) return false;
+    for (int i = 0; i < m_slot; i++)
+    {
+        quint64 value = shared->instance_slots[i].load(std::memory_order_acquire);
+        if (value && !isSlotStale(value)) return false;
+    }
+
+    return true;
+}
+
+int
+QApplicationLock::lockKernelFile()
+{
+    //Try to take an exclusive lock on the guard file, without blocking
+    //1: acquired (fd kept open), 0: held by another process, -1: error
+    //The guard file records the owner (pid, start time)
+    if (!m_kernel_lock) return -1;
+    bool busy = false;
+    if (m_kernel_lock->tryLock(&busy))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "kernel lock acquired" << m_kernel_lock_filename;
+        return 1;
+    }
+    if (!busy)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "kernel lock failed" << m_kernel_lock_filename;
+        return -1;
+    }
+    return 0;
+}
+
+void
+QApplicationLock::unlockKernelFile()
+{
+    //Closing the fd releases the lock, the guard file is not removed
+    if (m_kernel_lock) m_kernel_lock->unlock();
+}
+
+bool
+QApplicationLock::waitForProcessExit(qint64 pid, qint64 start_time, qint64 timeout)
+{
+    //Wait until the process has exited or the timeout (ms, -1: no timeout)
+    //but no longer than one heartbeat interval, so that the caller
+    //can check the lock again
+    //Returns true if the process is gone
+    int wait = m_update_interval;
+    if (timeout >= 0 && timeout < wait) wait = timeout;
+
+    //Unknown pid (lock without segment yet), check again after a while
+    if (pid <= 0)
+    {
+        QThread::msleep(wait);
+        return false;
+    }
+
+    Segment seg{};
+    seg.pid = pid;
+    seg.start_time = start_time;
+    if (isProcessGone(seg)) return true;
+
+#if defined(Q_OS_UNIX)
+
+    //pidfd on Linux (5.3), otherwise it's checked periodically
+    return ApplicationLock::waitForProcessExit(pid, start_time, wait);
+
+#elif defined(Q_OS_WIN)
+
+    HANDLE win_proc = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    if (win_proc)
+    {
+        DWORD ret = WaitForSingleObject(win_proc, wait);
+        CloseHandle(win_proc);
+        return ret == WAIT_OBJECT_0;
+    }
+
+#endif
+
+    //No pidfd (old kernel, other platform), check again after a while
+    QThread::msleep(wait);
+    return isProcessGone(seg);
+}
+
+bool
+QApplicationLock::checkLockFile(bool force_read)
+{
+    //Check lock file record for changes (sequence number)
+    //If the file has been replaced or removed, the open one is not
+    //the lock file anymore, it's opened again and re-read
+    bool replaced = false;
+    qint64 file_mtime = lockFileTime(&replaced);
+    if (replaced)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: lock file replaced, reopening";
+        m_lock_file.close();
+        m_lock_file_info.refresh();
+        openExistingLock();
+        file_mtime = lockFileTime();
+        force_read = true;
+    }
+
+    //Re-read file only if the record has changed (sequence number,
+    //bumped by every write), the mtime can't tell: it's also our heartbeat,
+    //a request written right before the heartbeat would look unchanged
+    if (!force_read && m_lock_file_seq >= 0 && lockFileSeq() == m_lock_file_seq)
+        return false;
+
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: checking/reading lock";
+    countStat(&Stats::rereads);
+    bool ok = false;
+    Segment seg = readExistingLock(&ok, true); //kept open for the heartbeat
+    m_lock_file_seq = ok ? seg.seq : -1;
+
+    //Another instance has taken over (considered the lock stale)
+    //and written its own record (generation, pid)
+    if (ok && (seg.generation != m_generation || seg.pid != QCoreApplication::applicationPid()))
+    {
+        loseLock(seg.pid);
+        return true;
+    }
+
+    //Requests written since the last read, each one is reported
+    //(the flag alone would merge requests written in between)
+    qint64 requests = ok ? seg.requests - m_requests_seen : 0;
+    if (requests > 0)
+    {
+        //Request signal received (flag was set)
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: requests detected" << requests;
+        m_requests_seen = seg.requests;
+        recordRequest(requests, file_mtime); //written by the request
+        //Messages first (the directory might not be watched)
+        drainMessages();
+        for (qint64 i = 0; i < requests; i++)
+            emit instanceRequested();
+    }
+    if (ok && seg.request)
+    {
+        //Reset flag, deferred (in place, the file is still watched)
+        //Skipped if another request has been written in the meantime
+        //The count stays, it's only ever increased
+        seg.request = false;
+        writeFileAsync(serializeSegment(seg), seg.seq);
+    }
+
+    return true;
+}
+
+bool
+QApplicationLock::waitForHeartbeat(const Segment &segment, qint64 timeout)
+{
+    //Wait (monotonic) for the lock file's mtime to change,
+    //up to two heartbeat intervals of the primary instance (read from
+    //the lock, so not longer than the stale timeout)
+    //but not longer than the timeout (ms, -1: no timeout)
+    //The wait counts from the first call that has seen this mtime,
+    //so a caller with a short timeout (tryAcquireFor(), standby) can
+    //continue it with the next call
+    //Returns true if it has been updated (primary instance alive)
+    //or if the timeout has cut the wait short (in doubt, check again)
+    qint64 interval = segment.interval > 0 ? segment.interval : m_update_interval.load();
+    qint64 max_wait = qMin(interval * 2, (qint64)m_stale_timeout);
+    qint64 last_time = lockFileTime();
+    if (!last_time) return false; //removed
+    if (last_time != m_stale_heartbeat || !m_stale_heartbeat_timer.isValid())
+    {
+        m_stale_heartbeat = last_time;
+        m_stale_heartbeat_timer.start();
+    }
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: lock looks stale, waiting for heartbeat" << interval;
+
+    QElapsedTimer timer;
+    timer.start();
+    while (!m_stale_heartbeat_timer.hasExpired(max_wait))
+    {
+        qint64 wait = 100;
+        if (timeout >= 0)
+        {
+            if (timer.elapsed() >= timeout) return true;
+            wait = qMin(wait, timeout - timer.elapsed());
+        }
+        QThread::msleep(wait);
+        qint64 file_time = lockFileTime();
+        if (!file_time) return false; //removed
+        if (file_time != last_time)
+        {
+            m_stale_heartbeat_timer.invalidate();
+            return true;
+        }
+    }
+
+    m_stale_heartbeat_timer.invalidate();
+    return false;
+}
+
+void
+QApplicationLock::loseLock(qint64 pid)
+{
+    //Another instance has taken over the lock, stop updating it
+    //(and don't remove it when closing, it's not ours anymore)
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: lock lost to" << pid << "generation:" << m_generation;
+    m_active = false;
+    emit lockLost(pid);
+}
+
+bool
+QApplicationLock::claimLease(const Segment &segment, bool found)
+{
+    //Claim the next fencing token by creating its token file exclusively
+    //(O_EXCL is atomic, also on a network filesystem), so only one
+    //instance gets it, even if several take over the same expired lease
+    //A token file beyond the token of the record we've read means that
+    //another instance is claiming (or has claimed) the lease already,
+    //unless it's older than a lease (claim abandoned, e.g., crashed)
+    //The token files of previous leases are removed
+    QFileInfo lock_info(m_lock_file.fileName());
+    QDir lease_dir(lock_info.path());
+    QString prefix = lock_info.fileName() + ".lease.";
+    QStringList token_files = lease_dir.entryList(QStringList() << prefix + "*", QDir::Files | QDir::Hidden);
+    qint64 token = segment.token;
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    for (const QString &filename : token_files)
+    {
+        qint64 file_token = filename.mid(prefix.size()).toLongLong();
+        if (file_token <= segment.token) continue;
+        qint64 file_age = QFileInfo(lease_dir.filePath(filename)).lastModified().toUTC().msecsTo(now);
+        if (file_age < m_lease_time)
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "lease token" << file_token << "claimed by another instance";
+            return false;
+        }
+        token = qMax(token, file_token);
+    }
+    token++;
+
+    QString token_path = lease_dir.filePath(prefix + QString::number(token));
+    if (!createExclusive(token_path))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to claim lease token" << token;
+        return false;
+    }
+
+    //Another instance may have claimed and written the lease
+    //after we've read the record, then we back off
+    bool ok = false;
+    Segment current = readExistingLock(&ok);
+    if (ok != found || (ok && (current.seq != segment.seq || current.token != segment.token)))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "lease record changed, token" << token << "given up";
+        lease_dir.remove(token_path);
+        return false;
+    }
+
+    for (const QString &filename : token_files)
+        lease_dir.remove(filename);
+
+    QAPP_PROCESS_LOCK_QDEBUG << "lease claimed, token" << token;
+    m_lease_token = token;
+    return true;
+}
+
+bool
+QApplicationLock::renewLease()
+{
+    //Renew the lease (primary instance), the record is rewritten
+    //with a new expiry, requests (count) are handled at the same time
+    //If another instance has taken over (our lease has expired,
+    //e.g., while suspended), it's not overwritten, we step down
+    if (!m_active) return false;
+    bool ok = false;
+    Segment seg = readExistingLock(&ok, true);
+    if (!ok) return false;
+    if (seg.token != m_lease_token)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: lease lost to" << seg.hostname << seg.pid << "token:" << seg.token;
+        loseLock(seg.pid);
+        return false;
+    }
+
+    qint64 requests = seg.requests - m_requests_seen;
+    seg.request = false;
+    seg.time = timestamp(true);
+    seg.expiry = seg.time + m_lease_time;
+    if (!writeFile(serializeSegment(seg), seg.seq))
+        return false; //changed in the meantime (request) or being written, next time
+    recordHeartbeat();
+
+    if (requests > 0)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: requests detected" << requests;
+        m_requests_seen = seg.requests;
+        recordRequest(requests);
+        drainMessages();
+        for (qint64 i = 0; i < requests; i++)
+            emit instanceRequested();
+    }
+
+    return true;
+}
+
+bool
+QApplicationLock::releaseLease()
+{
+    //Let the lease expire now, so the next instance doesn't have to wait
+    bool ok = false;
+    Segment seg = readExistingLock(&ok, true);
+    if (!ok || seg.token != m_lease_token) return false;
+    seg.expiry = 0;
+    return writeFile(serializeSegment(seg), seg.seq);
+}
+
+qint64
+QApplicationLock::lockFileTime(bool *replaced_ptr)
+{
+    //Lock file mtime (ms), a single fstat() on the open lock file
+    //A replaced (renamed over) or removed file has no links left,
+    //so that's detected without looking up the path every time
+    if (replaced_ptr) *replaced_ptr = false;
+
+#if !defined(Q_OS_WIN)
+    struct stat st;
+    if (m_lock_file.isOpen() && fstat(m_lock_file.handle(), &st) == 0)
+    {
+        if (replaced_ptr) *replaced_ptr = st.st_nlink == 0;
+#if defined(Q_OS_MAC)
+        return (qint64)st.st_mtimespec.tv_sec * 1000 + st.st_mtimespec.tv_nsec / 1000000;
+#else
+        return (qint64)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+#endif
+    }
+#endif
+
+    //Not open (or Windows), stat by path
+    m_lock_file_info.refresh(); //discard cached timestamp!
+    if (!m_lock_file_info.exists()) return 0;
+    return m_lock_file_info.lastModified().toUTC().toMSecsSinceEpoch();
+}
+
+qint64
+QApplicationLock::lockFileSeq()
+{
+    //Sequence number of the lock file record, -1 if it can't be read
+    //Only the header (magic, sequence) is read, a single pread()
+    //on the open lock file, the record is read if it has changed
+#if !defined(Q_OS_WIN)
+    uchar header[8];
+    if (m_lock_file.isOpen() && pread(m_lock_file.handle(), header, sizeof(header), 0) == sizeof(header) &&
+        qFromBigEndian<quint32>(header) == m_seg_magic)
+        return qFromBigEndian<quint32>(header + 4);
+#endif
+
+    return -1;
+}
+
+bool
+QApplicationLock::touchLockFile(qint64 ts_ms)
+{
+    //Heartbeat, set mtime of the open lock file (futimens())
+    //instead of opening it by name every time
+#if !defined(Q_OS_WIN)
+    if (m_lock_file.isOpen())
+    {
+        struct timespec times[2];
+        times[0].tv_sec = ts_ms / 1000;
+        times[0].tv_nsec = (ts_ms % 1000) * 1000000;
+        times[1] = times[0];
+        if (futimens(m_lock_file.handle(), times) == 0)
+            return true;
+        QAPP_PROCESS_LOCK_QDEBUG << "Failed to set modification time for" << m_lock_file.fileName();
+        return false;
+    }
+#endif
+
+    return setFileTime(m_lock_file.fileName(), ts_ms / 1000, ts_ms);
+}
+
+QFileSystemWatcher*
+QApplicationLock::fileWatcher(bool create)
+{
+    //Lock file watcher (inotify on Linux), picks up requests immediately
+    //In file mode, the timer is then only needed for the heartbeat
+    //Locks of a registry share its watcher (one inotify instance),
+    //it passes the changes on to the lock with that path
+    if (m_registry) return &m_registry->m_file_watcher;
+    if (!m_lock_file_watcher && create)
+    {
+        m_lock_file_watcher.reset(new QFileSystemWatcher);
+        connect(m_lock_file_watcher.data(), SIGNAL(fileChanged(QString)), SLOT(lockFileChanged(QString)));
+        connect(m_lock_file_watcher.data(), SIGNAL(directoryChanged(QString)), SLOT(messageDirChanged()));
+    }
+    return m_lock_file_watcher.data();
+}
+
+bool
+QApplicationLock::watchLockFile()
+{
+    //Not used by the update thread, the watcher lives in the GUI thread
+    //(the timer is always running in this case)
+    if (m_update_thread) return false;
+
+    //Watch the lock file, (re)adding the path makes sure that the
+    //current file is watched, not a replaced one (e.g., a leftover
+    //that has been removed and created again)
+    QString file_path = m_lock_file.fileName();
+    QFileSystemWatcher *watcher = fileWatcher();
+    if (watcher->files().contains(file_path))
+        watcher->removePath(file_path);
+    if (!watcher->addPath(file_path))
+    {
+        //Fall back to polling (timer might be off with a kernel lock)
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: failed to watch lock file, polling only";
+        startUpdateTimer();
+        return false;
+    }
+
+    return true;
+}
+
+bool
+QApplicationLock::isProcessGone(const Segment &segment)
+{
+    //Try to check if the primary process is still running
+    //This is not always possible, but if the system says that
+    //there's no such process, that's a definitive answer, in any scope
+    //No permission (other user) means that the process exists
+
+    //true if process gone, false in doubt
+    if (segment.pid <= 0) return false;
+
+    //A pid of another host (shared directory) can't be checked
+    if (!segment.hostname.isEmpty() && segment.hostname != QSysInfo::machineHostName())
+        return false;
+    QAPP_PROCESS_LOCK_QDEBUG << "trying to check if process is gone" << segment.pid;
+
+#if defined(Q_OS_UNIX) //Linux
+
+    //A 0 signal to the primary process is used
+    //to determine if it's still running, then the start time is compared
+    //(in case the pid has been reused), see ApplicationLock
+    if (ApplicationLock::isProcessGone(segment.pid, segment.start_time))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "pid is gone or has been reused" << segment.pid;
+        return true;
+    }
+    return false;
+
+#elif defined(Q_OS_WIN) //Windows
+
+    HANDLE win_proc = OpenProcess(SYNCHRONIZE, FALSE, segment.pid);
+    if (!win_proc)
+    {
+        //No such process (access denied: process of another user)
+        if (GetLastError() == ERROR_INVALID_PARAMETER)
+            return true;
+    }
+    else
+    {
+        DWORD ret = WaitForSingleObject(win_proc, 0);
+        CloseHandle(win_proc);
+        if (ret != WAIT_TIMEOUT)
+            return true;
+    }
+
+#endif
+
+    //The primary process is running (or, in case of an error, another one)
+    //If the pid has been reused by another process after the primary
+    //has crashed, the start time is different
+    //This also works for processes of other users (/proc is readable)
+    if (segment.start_time)
+    {
+        qint64 start_time = processStartTime(segment.pid);
+        if (start_time && start_time != segment.start_time)
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "pid has been reused" << segment.pid << start_time << segment.start_time;
+            return true;
+        }
     }
 
     return false; //default response - it's not gone or we don't know
 }
 
+qint64
+QApplicationLock::staleAge(const Segment &segment) const
+{
+    //Age (ms) after which a lock is considered stale
+    //Either a number of missed heartbeats (of the primary's interval)
+    //or the fixed timeout
+    if (m_max_missed > 0)
+    {
+        qint64 interval = segment.interval > 0 ? segment.interval : m_update_interval.load();
+        return interval * m_max_missed;
+    }
+
+    return m_stale_timeout;
+}
+
 bool
 QApplicationLock::isOpen() const
 {
-    if (m_use_shmem)
+    if (m_use_mmap)
+        return m_mmap_data;
+    else if (m_use_shmem)
         return m_q_shmem.isAttached();
     else if (m_use_file)
         return m_lock_file.isOpen();
+#ifdef QT_NETWORK_LIB
+    else if (m_use_socket)
+        return m_local_server.isListening();
+#endif
     else
         return false;
 }
@@ -480,7 +2610,13 @@ QApplicationLock::openExistingLock(bool request_write_access)
     bool ok = false;
 
     //Open *existing* lock, fails if lock does not exist yet
-    if (m_use_shmem)
+    if (m_use_mmap)
+    {
+        //Always mapped for writing, it's the user's own file
+        unmapFile();
+        ok = mapFile(false);
+    }
+    else if (m_use_shmem)
     {
         if (m_q_shmem.isAttached()) m_q_shmem.detach(); //close read-only fd
         if (request_write_access)
@@ -530,17 +2666,26 @@ QApplicationLock::readExistingLock(bool *ok_ptr, bool keep_open)
     else if (m_use_file)
     {
         //Read lock file, if found and non-empty
-        //Lock file should not be written to at the same time
-        //to avoid reading incomplete file
-        m_lock_file.seek(0);
-        QByteArray bytes = m_lock_file.readAll();
-        seg = readSegment(bytes, &ok);
+        //The record is updated in place, if it's been written
+        //at the same time (checksum mismatch), it's read again
+        QByteArray bytes;
+        quint32 seq = 0;
+        bool torn = false;
+        for (int i = 0; i < m_read_retries; i++)
+        {
+            m_lock_file.seek(0);
+            bytes = readRecord(m_lock_file.readAll(), &seq, &ok, &torn);
+            if (!torn) break;
+            countStat(&Stats::torn_reads);
+            QThread::yieldCurrentThread();
+        }
+        if (ok) seg = readSegment(bytes, &ok);
+        seg.seq = seq;
 
         //If timestamp is 0, the file's mtime is the last update timestamp
         if (!seg.time || true) //always using metadata in file mode
         {
-            qint64 file_mtime = m_lock_file_info.lastModified().toMSecsSinceEpoch();
-            seg.time = file_mtime;
+            seg.time = lockFileTime();
         }
     }
 
@@ -559,7 +2704,19 @@ QApplicationLock::createLock(const Segment &segment)
 {
     bool ok = false;
 
-    if (m_use_shmem)
+    if (m_use_mmap)
+    {
+        //Create and map the segment file, or map the existing one
+        //In robust mode, it's already mapped (holding the owner mutex)
+        if (m_use_robust && m_mmap_data)
+            ok = true;
+        else
+        {
+            unmapFile();
+            ok = mapFile(true);
+        }
+    }
+    else if (m_use_shmem)
     {
         //Create and attach to shmem lock, which should not exist at this point
         if (m_q_shmem.isAttached()) m_q_shmem.detach();
@@ -584,27 +2741,64 @@ QApplicationLock::createLock(const Segment &segment)
         ok = m_lock_file.open(QFile::ReadWrite);
         if (!ok)
             QAPP_PROCESS_LOCK_QDEBUG << "failed to create lock file" << m_lock_file.fileName();
+        //Message directory for secondary instances, private (mode 0700)
+        //A directory created by someone else is not used (no messages)
+        if (ok && !createPrivateDir(m_msg_dir))
+            QAPP_PROCESS_LOCK_QDEBUG << "failed to create message directory (or not private)" << m_msg_dir;
     }
 
     ok = ok && writeLock(segment);
 
+    //Generation of this lock, checked by updateLock()
+    //In shmem mode, it's an atomic counter in the segment, bumped here
+    //(an old primary instance may still be attached to it)
+    if (ok && m_use_shmem)
+        m_generation = sharedSegment()->generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+    else if (ok)
+        m_generation = segment.generation;
+
+    //Request count of our record (file mode), it starts with the record
+    //which is read once (sequence number unknown), see checkLockFile()
+    if (ok) m_requests_seen = segment.requests;
+    m_lock_file_seq = -1;
+
+    //Requests queued before we took over (leftover) are not for us
+    if (ok && m_use_shmem)
+    {
+        SharedSegment *shared = sharedSegment();
+        shared->ring_tail.store(shared->ring_head.load(std::memory_order_acquire), std::memory_order_release);
+        shared->ring_overflow.store(0, std::memory_order_relaxed);
+    }
+
+    //Neither is the state published by the previous primary instance
+    if (ok) clearState();
+
     return ok;
 }
 
 qint64
 QApplicationLock::lockAge(Segment segment, qint64 *last_updated_ptr)
 {
+    //Heartbeat on the monotonic clock (shmem mode), not affected
+    //by clock steps or suspend, negative if it's from before a reboot
+    //(a mapped file may survive that), then the wall clock is used
+    if (segment.mono_time > 0)
+    {
+        qint64 age = monotonicTimestamp() - segment.mono_time;
+        if (age >= 0)
+        {
+            if (last_updated_ptr) *last_updated_ptr = segment.time;
+            return age;
+        }
+    }
+
     //Get mtime, last updated (ms)
     qint64 lock_time = segment.time;
     if (m_use_file)
     {
         //In file mode, file mtime is used to avoid rewriting the file every 1s
         if (!segment.time)
-        {
-            m_lock_file_info.refresh(); //discard cached timestamp!
-            qint64 file_mtime = m_lock_file_info.lastModified().toUTC().toMSecsSinceEpoch();
-            lock_time = file_mtime;
-        }
+            lock_time = lockFileTime();
     }
 
     qint64 age = 0;
@@ -620,16 +2814,67 @@ QApplicationLock::closeLock(bool no_cleanup)
 {
     bool close_ok = false;
 
-    if (m_use_shmem)
+    //Published state goes with the primary instance
+    if (!no_cleanup && m_active && m_max_instances == 1)
+        clearState();
+
+    //Counting lock, give up our slot, the table (segment) stays
+    //The lock file isn't used in this mode
+    if (m_max_instances > 1)
+    {
+        releaseSlot();
+        no_cleanup = true;
+    }
+
+    if (m_use_mmap)
+    {
+        //Unlike a shmem segment, the file is never removed automatically
+        //The primary instance removes it, unless it's been taken over
+        //The shared memory object (robust mode) isn't removed here,
+        //another instance may have opened it already, it's reused
+        //(a broken one is removed by the next instance, see initRobustLock())
+        SharedSegment *shared = sharedSegment();
+        if (!no_cleanup && m_active && shared && !m_use_robust &&
+            shared->pid.load(std::memory_order_relaxed) == QCoreApplication::applicationPid())
+            QFile::remove(m_mmap_filename);
+        unmapFile();
+        close_ok = true;
+    }
+    else if (m_use_shmem)
     {
         close_ok = m_q_shmem.detach();
     }
     else if (m_use_file)
     {
+        //Lease mode, the lock file isn't removed, the lease is released
+        //(expired), the record keeps the fencing token for the next one
+        if (!no_cleanup && m_lease_time > 0)
+        {
+            if (m_active) releaseLease();
+            no_cleanup = true;
+        }
         m_lock_file.close();
         close_ok = true;
-        if (!no_cleanup) m_lock_file.remove();
+        if (!no_cleanup)
+        {
+            QFileSystemWatcher *watcher = fileWatcher(false);
+            if (watcher) watcher->removePath(m_lock_file.fileName());
+            m_lock_file.remove();
+            if (isPrivateDir(m_msg_dir))
+            {
+                if (watcher) watcher->removePath(m_msg_dir);
+                QDir(m_msg_dir).removeRecursively();
+            }
+        }
+    }
+#ifdef QT_NETWORK_LIB
+    else if (m_use_socket)
+    {
+        //Stop listening, removes the socket file
+        m_local_server.close();
+        close_ok = true;
     }
+#endif
 
     return close_ok;
 }
@@ -648,6 +2893,13 @@ QApplicationLock::readSegment(const QByteArray &bytes, bool *ok_ptr)
     >> seg.title
     >> seg.pid
     >> seg.request
+    >> seg.interval
+    >> seg.start_time
+    >> seg.hostname
+    >> seg.expiry
+    >> seg.token
+    >> seg.generation
+    >> seg.requests
     >> n; //end mark
     e = n;
 
@@ -669,13 +2921,58 @@ QApplicationLock::readSegment(const QByteArray &bytes, bool *ok_ptr)
 QApplicationLock::Segment
 QApplicationLock::readSegment(bool *ok_ptr)
 {
-    m_q_shmem.lock();
-    QBuffer shmem_buffer_in;
-    shmem_buffer_in.setData((char*)m_q_shmem.constData(),
-        m_q_shmem.size());
-    m_q_shmem.unlock();
+    Segment seg{};
+    bool ok = false;
+    const SharedSegment *shared = sharedSegment();
+
+    //Lock-free read (seqlock), no semaphore, no copy of the segment
+    //If the primary instance has been writing at the same time,
+    //the sequence number is odd or has changed, so it's read again
+    for (int i = 0; shared && i < m_read_retries; i++)
+    {
+        quint32 seq = shared->seq.load(std::memory_order_acquire);
+        if (i) countStat(&Stats::torn_reads);
+        if (seq & 1)
+        {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+
+        quint32 magic = shared->magic.load(std::memory_order_relaxed);
+        quint32 version = shared->version.load(std::memory_order_relaxed);
+        seg.ctime = shared->ctime.load(std::memory_order_relaxed);
+        seg.time = shared->time.load(std::memory_order_relaxed);
+        seg.mono_time = shared->mono_time.load(std::memory_order_relaxed);
+        seg.pid = shared->pid.load(std::memory_order_relaxed);
+        seg.generation = shared->generation.load(std::memory_order_relaxed);
+        seg.interval = shared->interval.load(std::memory_order_relaxed);
+        seg.start_time = shared->start_time.load(std::memory_order_relaxed);
+        char title[sizeof(shared->title)];
+        memcpy(title, shared->title, sizeof(title));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shared->seq.load(std::memory_order_relaxed) != seq)
+            continue; //torn read, try again
+
+        if (magic != m_seg_magic || version != m_seg_version)
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "failed to read process lock, unknown layout" << magic << version;
+            break;
+        }
+        title[sizeof(title) - 1] = 0;
+        seg.title = QString::fromUtf8(title);
+        ok = true;
+        break;
+    }
+
+    if (!ok)
+    {
+        seg = Segment();
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to read process lock";
+    }
 
-    return readSegment(shmem_buffer_in.data(), ok_ptr);
+    if (ok_ptr) *ok_ptr = ok;
+    return seg;
 }
 
 QByteArray
@@ -688,6 +2985,13 @@ QApplicationLock::serializeSegment(const Segment &segment)
     stream << segment.title;
     stream << segment.pid;
     stream << segment.request;
+    stream << segment.interval;
+    stream << segment.start_time;
+    stream << segment.hostname;
+    stream << segment.expiry;
+    stream << segment.token;
+    stream << segment.generation;
+    stream << segment.requests;
     stream << (qint8)'E'; //end mark
     QByteArray bytes = shmem_buffer_out.data();
 
@@ -695,79 +2999,580 @@ QApplicationLock::serializeSegment(const Segment &segment)
 }
 
 bool
-QApplicationLock::writeSegment(const QByteArray &bytes)
+QApplicationLock::writeSegment(const Segment &segment)
 {
-    assert(m_q_shmem.isAttached());
-
-    const char *from = bytes.data();
-    assert(bytes.size() < m_seg_size);
-
-    m_q_shmem.lock();
-    char *to = (char*)m_q_shmem.data();
-    memcpy(to, from, bytes.size()); //or m_q_shmem.size()
-    m_q_shmem.unlock();
+    SharedSegment *shared = sharedSegment();
+    assert(shared);
+
+    //Only the primary instance writes the segment (seqlock writer),
+    //readers retry while the sequence number is odd
+    quint32 seq = shared->seq.load(std::memory_order_relaxed);
+    shared->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    QByteArray title = segment.title.toUtf8().left(sizeof(shared->title) - 1);
+    memset(shared->title, 0, sizeof(shared->title));
+    memcpy(shared->title, title.constData(), title.size());
+    shared->magic.store(m_seg_magic, std::memory_order_relaxed);
+    shared->version.store(m_seg_version, std::memory_order_relaxed);
+    shared->ctime.store(segment.ctime, std::memory_order_relaxed);
+    shared->time.store(segment.time, std::memory_order_relaxed);
+    shared->mono_time.store(segment.mono_time, std::memory_order_relaxed);
+    shared->pid.store(segment.pid, std::memory_order_relaxed);
+    shared->interval.store(segment.interval, std::memory_order_relaxed);
+    shared->start_time.store(segment.start_time, std::memory_order_relaxed);
+
+    shared->seq.store(seq + 2, std::memory_order_release);
 
     return true;
 }
 
-bool
-QApplicationLock::writeFile(const QByteArray &bytes)
+QByteArray
+QApplicationLock::serializeRecord(const QByteArray &bytes, quint32 seq)
 {
+    //Lock file record: magic, sequence, segment, checksum of all that
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << m_seg_magic << seq << bytes;
+    stream << (quint16)qChecksum(record.constData(), record.size());
+
+    return record;
+}
 
-    //Note that the reader must reopen the replaced file
-    //rename():
-    //This functionality is intended to support materializing the destination file with all contents already present, so another process cannot see an incomplete file in the process of being written.
-    bool write_ok = false;
+QByteArray
+QApplicationLock::readRecord(const QByteArray &record, quint32 *seq_ptr, bool *ok_ptr, bool *torn_ptr)
+{
+    //Returns the segment bytes of a valid record
+    //Torn: a concurrent write was seen (checksum mismatch), read again
+    quint32 magic = 0;
+    quint32 seq = 0;
+    QByteArray bytes;
+    quint16 checksum = 0;
+    QDataStream stream(record);
+    stream >> magic >> seq >> bytes;
+    int size = stream.device()->pos();
+    stream >> checksum;
+
+    bool ok = magic == m_seg_magic && stream.status() == QDataStream::Ok;
+    bool torn = ok && checksum != qChecksum(record.constData(), size);
+    if (!ok)
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to read process lock, unknown record";
+    ok = ok && !torn;
+    if (!ok) bytes.clear();
+
+    if (seq_ptr) *seq_ptr = seq;
+    if (ok_ptr) *ok_ptr = ok;
+    if (torn_ptr) *torn_ptr = torn;
+    return bytes;
+}
 
-    //Write via temp file and replace lock file (atomic)
-    QSaveFile save_file(m_lock_file.fileName());
-    bool open_ok = save_file.open(QIODevice::WriteOnly);
-    write_ok = save_file.write(bytes) == bytes.size();
-    if (m_lock_file.isOpen()) m_lock_file.close(); //for some platforms (commit)...
-    bool save_ok = save_file.commit();
-    const int repeat_delays[] = {1, 100, 200};
-    //improve error handling in case other process has file open right now
-    for (int delay : repeat_delays)
+bool
+QApplicationLock::writeFile(const QByteArray &bytes, qint64 expected_seq, bool *conflict_ptr)
+{
+    //Update the record in place with a single write, no temp file,
+    //no rename and nothing to retry (the lock file is never replaced)
+    //Readers detect a torn write by the checksum and read it again
+    //If expected_seq is set, the record is only written if it hasn't
+    //changed since it's been read (i.e., no new request in between)
+    //Writers hold a lock on the file from reading the sequence number
+    //to writing the record, so a request written by a secondary instance
+    //can't be overwritten by the primary instance resetting the flag
+    //If another writer holds that lock, it's not waited for, the record
+    //isn't written (conflict), the caller tries again later
+    if (conflict_ptr) *conflict_ptr = false;
+    QFile file(m_lock_file.fileName());
+    if (!file.open(QFile::ReadWrite | QFile::Unbuffered))
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to open lock file for writing" << file.fileName();
+        countStat(&Stats::write_failures);
+        return false;
+    }
+#if !defined(Q_OS_WIN)
+    bool busy = false;
+    if (!lockRecordFile(file.handle(), &busy))
     {
-        if (!write_ok || save_ok) break; //repeat only if initial commit failed
-        QThread::msleep(delay);
-        save_ok = save_file.commit();
-        if (save_ok) break;
+        if (busy)
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "lock file is being written, not written" << file.fileName();
+            countStat(&Stats::write_conflicts);
+            if (conflict_ptr) *conflict_ptr = true;
+            return false;
+        }
+        QAPP_PROCESS_LOCK_QDEBUG << "failed to lock lock file, writing anyway" << file.fileName();
     }
-    write_ok = write_ok && save_ok;
+#endif
 
-    //Write directly into lock file (not very atomic)
-    if (0 /* not atomic */)
+    quint32 seq = 0;
+    bool ok = false;
+    readRecord(file.readAll(), &seq, &ok);
+    if (expected_seq >= 0 && ok && seq != expected_seq)
     {
-        m_lock_file.seek(0);
-        m_lock_file.write(bytes);
-        m_lock_file.seek(0);
+        QAPP_PROCESS_LOCK_QDEBUG << "lock file has changed, not written" << seq << expected_seq;
+        countStat(&Stats::write_conflicts);
+        if (conflict_ptr) *conflict_ptr = true;
+        return false;
     }
 
+    //A shorter record leaves the end of the old one behind for a moment,
+    //it's ignored by readers (the segment has a size)
+    QByteArray record = serializeRecord(bytes, seq + 1);
+    file.seek(0);
+    bool write_ok = file.write(record) == record.size();
+    if (write_ok && file.size() > record.size())
+        file.resize(record.size());
+    if (!write_ok) countStat(&Stats::write_failures);
+
     return write_ok;
 }
 
+void
+QApplicationLock::writeFileAsync(const QByteArray &bytes, qint64 expected_seq)
+{
+    //Deferred write, doesn't block the caller (e.g., a slot on the GUI
+    //thread), runs on the update thread, if any, lockWritten() when done
+    QObject *context = m_thread_timer ? static_cast<QObject*>(m_thread_timer) : this;
+    QTimer::singleShot(0, context, [this, bytes, expected_seq]()
+    {
+        emit lockWritten(writeFile(bytes, expected_seq));
+    });
+}
+
 bool
-QApplicationLock::writeLock(const QByteArray &bytes)
+QApplicationLock::writeLock(const Segment &segment)
 {
     bool ok = false;
 
     if (m_use_shmem)
     {
-        //Lock, read, unlock using Qt's QSharedMemory
-        ok = writeSegment(bytes);
+        //Write segment fields in place
+        ok = writeSegment(segment);
     }
     else if (m_use_file)
     {
-        ok = writeFile(bytes);
+        //The record lock is only held for a moment by another writer,
+        //a busy one is tried again for a while (no heartbeat here)
+        QElapsedTimer timer;
+        timer.start();
+        bool conflict = false;
+        QByteArray bytes = serializeSegment(segment);
+        while (!(ok = writeFile(bytes, -1, &conflict)) && conflict && !timer.hasExpired(m_socket_timeout))
+            QThread::msleep(1);
     }
 
     return ok;
 }
 
 bool
-QApplicationLock::writeLock(const Segment &segment)
+QApplicationLock::sendRequest()
+{
+    bool ok = false;
+
+    if (m_use_shmem)
+    {
+        //Queue request record (with message), no semaphore,
+        //so concurrent requests are all delivered
+        ok = appendRequest(m_message);
+    }
+    else if (m_use_file)
+    {
+        //The message (if any) goes first, so that it's there
+        //by the time the primary instance sees the request
+        if (!m_message.isEmpty()) postMessage(m_message);
+
+        //Set request flag, read-modify-write of the current record
+        //Only the flag is ours, the rest is the primary instance's,
+        //which may have changed since we've decided that it's running
+        //(taken over, lease renewed), so it's read again right here
+        //The write is skipped if the record has been written in between
+        //(or another writer holds it), then it's read again
+        QElapsedTimer timer;
+        timer.start();
+        do
+        {
+            bool found = false;
+            Segment seg = readExistingLock(&found, true);
+            bool conflict = !found; //not written yet (or just now)
+            if (found)
+            {
+                seg.request = true;
+                seg.requests++; //counted, concurrent requests aren't merged
+                ok = writeFile(serializeSegment(seg), seg.seq, &conflict);
+            }
+            if (ok || !conflict) break;
+            QThread::msleep(1);
+        }
+        while (!timer.hasExpired(m_socket_timeout));
+        if (!ok)
+            QAPP_PROCESS_LOCK_QDEBUG << "failed to write request" << m_lock_file.fileName();
+    }
+
+    return ok;
+}
+
+QByteArray
+QApplicationLock::serializeMessage(const QStringList &args, const QByteArray &payload, const QString &reply_name)
+{
+    QByteArray bytes;
+    QDataStream stream(&bytes, QIODevice::WriteOnly);
+    stream << (qint64)QCoreApplication::applicationPid();
+    stream << QDir::currentPath();
+    stream << args;
+    stream << payload;
+    stream << reply_name; //empty if no reply is expected
+    stream << (qint8)'E'; //end mark
+
+    return bytes;
+}
+
+bool
+QApplicationLock::receiveMessage(const QByteArray &bytes)
+{
+    qint64 pid = 0;
+    QString working_dir;
+    QStringList args;
+    QByteArray payload;
+    QString reply_name;
+
+    QChar e = 0;
+    qint8 n = 0;
+    QDataStream stream(bytes);
+    stream
+    >> pid
+    >> working_dir
+    >> args
+    >> payload
+    >> reply_name
+    >> n; //end mark
+    e = n;
+
+    if (e != 'E')
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: failed to read message, incomplete data";
+        return false;
+    }
+
+    QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: message received from" << pid << args;
+    emit messageReceived(args, payload, working_dir);
+
+    //The other instance waits for a reply (requestPrimary())
+    if (!reply_name.isEmpty())
+    {
+        Request request{pid, args, payload, working_dir, reply_name};
+        if (receivers(SIGNAL(requestReceived(QApplicationLock::Request))))
+            emit requestReceived(request);
+        else
+            reply(request, QByteArray()); //acknowledge
+    }
+
+    return true;
+}
+
+bool
+QApplicationLock::postMessage(const QByteArray &bytes)
+{
+    bool ok = false;
+
+    //Messages are bounded, the primary instance reads them as they are
+    if (bytes.size() > m_msg_size)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: message too large, not forwarded" << bytes.size();
+        return false;
+    }
+
+    if (m_use_file)
+    {
+        //One file per message, written via temp file + rename,
+        //so the primary instance never sees an incomplete message
+        //Only into the private directory of the primary instance (same user),
+        //the message (args, working directory) is readable by us only
+        if (!isPrivateDir(m_msg_dir))
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: message directory missing or not private" << m_msg_dir;
+            return false;
+        }
+        QDir msg_dir(m_msg_dir);
+        if (msg_dir.entryList(QStringList() << "*.msg", QDir::Files).size() >= m_msg_max_files)
+        {
+            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: too many pending messages";
+            return false;
+        }
+        QString filename = QString("%1-%2.msg")
+            .arg(timestamp(true), 16, 10, QChar('0'))
+            .arg(QCoreApplication::applicationPid());
+        QSaveFile save_file(msg_dir.filePath(filename));
+        ok = save_file.open(QIODevice::WriteOnly);
+        ok = ok && save_file.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner); //0600
+        ok = ok && save_file.write(bytes) == bytes.size();
+        ok = ok && save_file.commit();
+
+        if (!ok)
+            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: failed to write message" << filename;
+    }
+
+    return ok;
+}
+
+int
+QApplicationLock::drainMessages()
+{
+    QList<QByteArray> messages;
+
+    if (m_use_file)
+    {
+        //Read message files in order (oldest first), then remove them
+        //A directory that isn't private may contain messages of others
+        if (!isPrivateDir(m_msg_dir)) return 0;
+        QDir msg_dir(m_msg_dir);
+        QStringList filenames = msg_dir.entryList(QStringList() << "*.msg", QDir::Files, QDir::Name);
+        for (const QString &filename : filenames)
+        {
+            QFile file(msg_dir.filePath(filename));
+            if (file.open(QFile::ReadOnly))
+                messages.append(file.read(m_msg_size));
+            file.close();
+            file.remove();
+        }
+    }
+
+    for (const QByteArray &bytes : messages)
+        receiveMessage(bytes);
+
+    return messages.size();
+}
+
+bool
+QApplicationLock::appendRequest(const QByteArray &bytes)
+{
+    //Append a record to the request ring (multiple producers)
+    //A position is claimed by advancing the head (CAS), then the record
+    //is written and published, other secondary instances don't wait
+    SharedSegment *shared = sharedSegment();
+    if (!shared) return false;
+
+    //Messages are bounded, the request is sent without it
+    quint32 size = bytes.size();
+    if (size > (quint32)m_msg_size)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: message too large, not forwarded" << size;
+        size = 0;
+    }
+
+    quint64 head = shared->ring_head.load(std::memory_order_relaxed);
+    while (true)
+    {
+        //Ring full (primary instance busy), the request is coalesced
+        //with the other ones that didn't fit, only the message is lost
+        quint64 tail = shared->ring_tail.load(std::memory_order_acquire);
+        if (head - tail >= (quint64)m_ring_size)
+        {
+            shared->ring_overflow.fetch_add(1, std::memory_order_release);
+            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: request ring full, request coalesced";
+            return true;
+        }
+        if (shared->ring_head.compare_exchange_weak(head, head + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            break;
+    }
+
+    RequestRecord *record = requestRecord(head);
+    record->pid.store(QCoreApplication::applicationPid(), std::memory_order_relaxed);
+    record->time.store(timestamp(true), std::memory_order_relaxed);
+    record->size.store(size, std::memory_order_relaxed);
+    memcpy(record->payload, bytes.constData(), size);
+    record->seq.store(head + 1, std::memory_order_release);
+
+    return true;
+}
+
+int
+QApplicationLock::drainRequests()
+{
+    //Read all published records from the request ring (single consumer)
+    //The records are copied first and the positions released,
+    //so that secondary instances can append while the signals are handled
+    SharedSegment *shared = sharedSegment();
+    if (!shared) return 0;
+
+    QList<qint64> times;
+    QList<QByteArray> messages;
+    quint64 tail = shared->ring_tail.load(std::memory_order_relaxed);
+    quint64 head = shared->ring_head.load(std::memory_order_acquire);
+    while (tail != head)
+    {
+        RequestRecord *record = requestRecord(tail);
+        if (record->seq.load(std::memory_order_acquire) != tail + 1)
+        {
+            //Claimed but not published yet, the secondary instance
+            //is still writing it, it's picked up with the next update
+            //If that instance has died in between, it's skipped after a while
+            if (!m_ring_wait.isValid()) m_ring_wait.start();
+            if (m_ring_wait.elapsed() < m_socket_timeout) break;
+            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: skipping unpublished request" << tail;
+        }
+        else
+        {
+            quint32 size = qMin(record->size.load(std::memory_order_relaxed), (quint32)m_msg_size);
+            QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: request" << tail << "from" << record->pid.load(std::memory_order_relaxed);
+            times.append(record->time.load(std::memory_order_relaxed));
+            messages.append(QByteArray(record->payload, size));
+        }
+        m_ring_wait.invalidate();
+        tail++;
+        shared->ring_tail.store(tail, std::memory_order_release);
+    }
+
+    //Requests that didn't fit are reported once
+    quint32 coalesced = shared->ring_overflow.exchange(0, std::memory_order_acquire);
+
+    for (int i = 0; i < messages.size(); i++)
+    {
+        recordRequest(1, times.at(i));
+        if (!messages.at(i).isEmpty()) receiveMessage(messages.at(i));
+        emit instanceRequested();
+    }
+    if (coalesced)
+    {
+        QAPP_PROCESS_LOCK_QDEBUG << "qapp-lock: coalesced requests" << coalesced;
+        countStat(&Stats::coalesced, coalesced);
+        recordRequest(coalesced, 0);
+        emit instanceRequested();
+    }
+
+    return messages.size() + coalesced;
+}
+
+QApplicationLockRegistry::QApplicationLockRegistry(QObject *parent)
+                        : QObject(parent)
+{
+    //One timer for all locks, second accuracy is good enough for a
+    //heartbeat and allows the system to coalesce wakeups
+    m_timer.setTimerType(Qt::VeryCoarseTimer);
+    m_timer.setInterval(m_update_interval);
+    connect(&m_timer, SIGNAL(timeout()), SLOT(updateLocks()));
+
+    //One file watcher for all locks, see QApplicationLock::fileWatcher()
+    connect(&m_file_watcher, SIGNAL(fileChanged(QString)), SLOT(lockFileChanged(QString)));
+    connect(&m_file_watcher, SIGNAL(directoryChanged(QString)), SLOT(messageDirChanged(QString)));
+}
+
+QApplicationLockRegistry::~QApplicationLockRegistry()
+{
+    //Release all locks
+    QList<QApplicationLock*> locks = m_locks.values();
+    m_locks.clear();
+    m_scheduled.clear();
+    for (QApplicationLock *lock : locks)
+    {
+        lock->m_registry = 0;
+        delete lock;
+    }
+}
+
+QApplicationLock*
+QApplicationLockRegistry::lock(const QString &name, QApplicationLock::Scope scope)
+{
+    QApplicationLock *lock = m_locks.value(name);
+    if (lock) return lock;
+
+    //Not a child, deleted explicitly (see destructor)
+    lock = new QApplicationLock(name, scope);
+    lock->m_registry = this;
+    lock->setUpdateInterval(m_update_interval);
+    m_locks[name] = lock;
+    return lock;
+}
+
+QApplicationLock*
+QApplicationLockRegistry::find(const QString &name) const
+{
+    return m_locks.value(name);
+}
+
+void
+QApplicationLockRegistry::release(const QString &name)
+{
+    //Unregisters itself
+    delete m_locks.value(name);
+}
+
+QStringList
+QApplicationLockRegistry::names() const
+{
+    return m_locks.keys();
+}
+
+void
+QApplicationLockRegistry::setUpdateInterval(int msec)
+{
+    assert(msec > 0);
+    m_update_interval = msec;
+    m_timer.setInterval(msec);
+    for (QApplicationLock *lock : m_locks)
+        lock->setUpdateInterval(msec);
+}
+
+int
+QApplicationLockRegistry::updateInterval() const
+{
+    return m_update_interval;
+}
+
+void
+QApplicationLockRegistry::updateLocks()
+{
+    //Heartbeat of all locks in a single tick
+    //A lock might be released by a slot connected to one of its signals,
+    //so the set is copied and checked
+    //A lock that has lost its lock doesn't need a heartbeat anymore,
+    //it's scheduled again if it becomes the primary instance again
+    QSet<QApplicationLock*> scheduled = m_scheduled;
+    for (QApplicationLock *lock : scheduled)
+    {
+        if (m_scheduled.contains(lock) && lock->isLockActive())
+            lock->updateLock();
+        if (m_scheduled.contains(lock) && !lock->isLockActive())
+            m_scheduled.remove(lock);
+    }
+
+    if (m_scheduled.isEmpty()) m_timer.stop();
+}
+
+void
+QApplicationLockRegistry::lockFileChanged(const QString &path)
+{
+    //Pass the change on to the lock with that lock file
+    for (QApplicationLock *lock : m_locks)
+    {
+        if (lock->m_lock_file.fileName() != path) continue;
+        lock->lockFileChanged(path);
+        break;
+    }
+}
+
+void
+QApplicationLockRegistry::messageDirChanged(const QString &path)
+{
+    //Pass the change on to the lock with that message directory
+    for (QApplicationLock *lock : m_locks)
+    {
+        if (lock->m_msg_dir != path) continue;
+        lock->messageDirChanged();
+        break;
+    }
+}
+
+void
+QApplicationLockRegistry::scheduleUpdates(QApplicationLock *lock)
 {
-    return writeLock(serializeSegment(segment));
+    //Called by the lock instead of starting its own timer
+    m_scheduled.insert(lock);
+    if (!m_timer.isActive()) m_timer.start();
 }
 
+void
+QApplicationLockRegistry::remove(QApplicationLock *lock)
+{
+    //Called by the lock when it's deleted
+    m_scheduled.remove(lock);
+    m_locks.remove(m_locks.key(lock));
+    if (m_scheduled.isEmpty()) m_timer.stop();
+}
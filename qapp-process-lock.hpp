@@ -14,6 +14,8 @@
 #define QAPP_PROCESS_LOCK_HPP
 
 #include <cassert>
+#include <atomic>
+#include <chrono>
 #include <stdexcept>
 #include <sys/types.h>
 #include <signal.h>
@@ -24,6 +26,14 @@
 
 #include <unistd.h> //geteuid()
 #include <utime.h>
+#include <fcntl.h> //fcntl(), F_OFD_SETLK
+#include <sys/file.h> //flock()
+#include <sys/syscall.h> //SYS_pidfd_open
+#include <sys/mman.h> //mmap(), shm_open()
+#include <pthread.h> //robust mutex
+#include <sys/stat.h>
+#include <poll.h>
+#include <cerrno>
 
 #elif defined(Q_OS_WIN)
 //Windows
@@ -40,13 +50,28 @@
 #include <QTimer>
 #include <QDateTime>
 #include <QDataStream>
+#include <QtEndian>
 #include <QBuffer>
 #include <QFileInfo>
 #include <QTemporaryFile>
 #include <QSaveFile>
+#include <QFileSystemWatcher>
+#ifdef QT_NETWORK_LIB
+#include <QLocalServer> //QT += network, for socket mode and requestPrimary()
+#include <QLocalSocket>
+#endif
 #include <QDir>
 #include <QProcessEnvironment>
 #include <QThread>
+#include <QElapsedTimer>
+#include <QScopedPointer>
+#include <QMap>
+#include <QSet>
+#include <QMutex>
+#include <QMetaType>
+#include <QSysInfo>
+
+#include "app-process-lock.hpp" //Qt-free core (kernel lock, process checks)
 
 #ifdef QAPP_PROCESS_LOCK_LOG_DEBUG
 #define QAPP_PROCESS_LOCK_QDEBUG qDebug()
@@ -54,6 +79,8 @@
 #define QAPP_PROCESS_LOCK_QDEBUG if (false) qDebug()
 #endif
 
+class QApplicationLockRegistry;
+
 /**
  * QApplicationLock provides a locking mechanism for a Qt application,
  * limiting it to a single instance.
@@ -72,6 +99,8 @@ class QApplicationLock : public QObject
 {
     Q_OBJECT
 
+    friend class QApplicationLockRegistry;
+
 signals:
 
     void
@@ -80,9 +109,42 @@ signals:
     void
     otherInstanceDetected(qint64 pid = 0);
 
+    /**
+     * Another instance has requested this one (primary instance).
+     * Emitted for each request, requests that didn't fit into the
+     * request ring (shmem mode) are reported once per update.
+     * In file mode, the requests are counted in the lock file record,
+     * so requests written between two reads are each reported as well.
+     */
     void
     instanceRequested();
 
+    void
+    messageReceived(const QStringList &args, const QByteArray &payload, const QString &working_dir);
+
+    /**
+     * A deferred lock file write (request flag reset) has completed.
+     */
+    void
+    lockWritten(bool ok);
+
+    /**
+     * This instance has lost the lock, another instance has taken it
+     * over (e.g., considered it stale after this process had been
+     * suspended). This instance isn't the primary instance anymore,
+     * it should stop writing shared data. Not emitted in socket mode.
+     * With a counting lock, it's emitted if the slot of this instance
+     * has been taken over and there's no other free slot (shmem mode).
+     */
+    void
+    lockLost(qint64 pid);
+
+    /**
+     * This standby instance has taken over, it's the primary instance now.
+     */
+    void
+    promotedToPrimary();
+
 public:
 
     enum class Scope //: int
@@ -91,23 +153,105 @@ public:
         Global  = 0,
         User    = 1 << 1,
         X11     = 1 << 2,
+        Socket  = 1 << 3,
+        Mapped  = 1 << 4,
     };
 
     struct Segment
     {
         qint64 ctime;
         qint64 time;
+        qint64 mono_time; //heartbeat, monotonic clock (shmem mode)
         QString title;
         qint64 pid;
         bool request;
+        qint64 interval; //heartbeat interval of the primary instance (ms)
+        qint64 start_time; //start time of the primary process (see below)
+        QString hostname; //of the primary instance (file mode)
+        qint64 expiry; //lease mode, end of the lease (ms since epoch)
+        qint64 token; //lease mode, fencing token
+        qint64 generation; //bumped by every acquisition
+        quint32 seq; //lock file record sequence (file mode)
+        qint64 requests; //requests written to the lock file record (file mode)
     };
 
+    /**
+     * Runtime statistics of this instance, see stats().
+     * Times in ms unless noted otherwise.
+     */
+    struct Stats
+    {
+        qint64 heartbeats; //heartbeats written
+        qint64 heartbeat_max_gap; //longest time between two heartbeats
+        qint64 heartbeat_jitter; //mean deviation from the interval
+        qint64 heartbeat_max_jitter;
+        qint64 rereads; //lock (file) read again because it has changed
+        qint64 torn_reads; //reads repeated because of a concurrent write
+        qint64 takeovers; //stale locks (or slots) taken over
+        qint64 takeover_age; //age of the last one taken over
+        qint64 requests; //requests received
+        qint64 request_latency; //request to delivery, last one (if known)
+        qint64 request_max_latency;
+        qint64 write_failures; //lock file writes failed
+        qint64 write_conflicts; //lock file writes skipped (changed meanwhile)
+        qint64 coalesced; //requests merged because the request ring was full
+    };
+
+    /**
+     * Request that expects a reply, see requestPrimary().
+     */
+    struct Request
+    {
+        qint64 pid; //requesting instance
+        QStringList args;
+        QByteArray payload;
+        QString working_dir;
+        QString reply_name; //local socket of the requesting instance
+    };
+
+signals:
+
+    /**
+     * Periodic statistics, see setStatsInterval().
+     */
+    void
+    statsUpdated(const QApplicationLock::Stats &stats);
+
+    /**
+     * Another instance has called requestPrimary() and waits for
+     * the reply, which is sent with reply(). If this signal isn't
+     * connected, the request is acknowledged with an empty reply.
+     * Emitted after messageReceived(), before instanceRequested().
+     */
+    void
+    requestReceived(const QApplicationLock::Request &request);
+
+public:
+
     static qint64
     timestamp(bool milliseconds = false);
 
+    /**
+     * Monotonic timestamp (ms), not affected by clock steps
+     * and not advancing while the system is suspended.
+     * Used for the age of a heartbeat, system-wide (same machine).
+     */
+    static qint64
+    monotonicTimestamp();
+
     static bool
     setFileTime(const QString &file_path, qint64 new_ts, qint64 new_ts_ms = 0);
 
+    /**
+     * Start time of the process, 0 if unknown.
+     * Together with the pid, this identifies a process, even if the pid
+     * is reused after the process has exited (which is also what a pidfd
+     * refers to). It's only meant to be compared, the unit depends on
+     * the platform (clock ticks since boot on Linux, FILETIME on Windows).
+     */
+    static qint64
+    processStartTime(qint64 pid);
+
     static QString
     getUsername();
 
@@ -138,6 +282,27 @@ public:
      * in another session, for example, an XPRA session.
      * The default of -1 will create a system-global lock
      * using shared memory.
+     *
+     * Add the Socket flag to use a local socket instead of a file or
+     * shared memory segment. The primary instance listens on it and
+     * a secondary instance connecting to it is both the liveness check
+     * and the request. A crashed primary is detected right away
+     * (connection refused), no heartbeat is needed in this mode.
+     * It requires the Qt network module (QT_NETWORK_LIB), without it,
+     * the Socket flag is refused (std::invalid_argument).
+     *
+     * Add the Mapped flag (with User, Unix) to use a memory-mapped file
+     * in $XDG_RUNTIME_DIR (tmpfs) instead of a lock file. It has the
+     * layout of the shared memory segment, so the heartbeat and requests
+     * are plain memory stores, without a syscall, and the permissions
+     * are those of the user's runtime directory.
+     *
+     * The Mapped flag in global scope (Linux) uses a POSIX shared memory
+     * object (shm_open()) with a robust mutex held by the primary
+     * instance. If it dies, the next instance gets the mutex right away
+     * (EOWNERDEAD) and takes over, without waiting for the heartbeat.
+     * The mutex belongs to the thread that has initialized the lock,
+     * which must live as long as the lock (e.g., the main thread).
      */
     QApplicationLock(const QString &name = "", Scope scope = Scope::User, QObject *parent = 0);
     ~QApplicationLock();
@@ -161,11 +326,280 @@ public:
     bool
     isSecondaryInstance(qint64 *pid_ptr = 0);
 
+    /**
+     * Use a kernel lock in file mode (Unix).
+     * The primary instance holds an exclusive lock (OFD lock on Linux,
+     * flock() elsewhere) on a guard file next to the lock file.
+     * The kernel releases it as soon as the process exits or crashes,
+     * so the lock is never stale and no heartbeat is written,
+     * the decision primary/secondary is a single syscall.
+     * Must be called before the lock is initialized and all instances
+     * must use the same setting.
+     * Without it, the guard file is still checked (file mode), so a
+     * running ApplicationLock (Qt-free core) with the same name and scope
+     * is detected as the primary instance.
+     */
+    void
+    setKernelLockEnabled(bool enable);
+
+    /**
+     * Heartbeat interval (ms) of the primary instance.
+     * Defaults to 3000 in file mode, 1000 in shmem mode.
+     * It's stored in the lock, so that other instances know
+     * when a heartbeat is overdue.
+     */
+    void
+    setUpdateInterval(int msec);
+
+    int
+    updateInterval() const;
+
+    /**
+     * Fixed stale timeout (ms), an existing lock whose heartbeat is older
+     * is considered a leftover and taken over. Defaults to 15 seconds.
+     * Ignored if a number of missed heartbeats is set.
+     */
+    void
+    setStaleTimeout(int msec);
+
+    int
+    staleTimeout() const;
+
+    /**
+     * Adaptive stale timeout: an existing lock is considered a leftover
+     * after the given number of missed heartbeats, based on the interval
+     * stored by the primary instance. 0 (default) to use the fixed timeout.
+     *
+     * Either way, the lock is taken over immediately if the owner process
+     * is definitely gone.
+     */
+    void
+    setMaxMissedHeartbeats(int count);
+
+    int
+    maxMissedHeartbeats() const;
+
+    /**
+     * Same as isSecondaryInstance() but if another instance is running,
+     * the arguments (e.g., files to open) and the payload are forwarded
+     * to it, along with the working directory of this process.
+     * The primary instance emits messageReceived() before it emits
+     * instanceRequested().
+     *
+     * Messages are limited to m_msg_size bytes (serialized), they're
+     * queued in the request ring of the lock segment (shmem mode),
+     * in a private directory (mode 0700) in $XDG_RUNTIME_DIR or next to
+     * the lock file (file mode) or sent over the socket (socket mode).
+     * A message directory that isn't private is not used, the request
+     * is sent without its message. If the ring is full, the request is
+     * coalesced with the others that didn't fit and its message is
+     * dropped (see Stats::coalesced).
+     */
+    bool
+    isSecondaryInstance(const QStringList &args, const QByteArray &payload = QByteArray(), qint64 *pid_ptr = 0);
+
+    /**
+     * Same as isSecondaryInstance(), but waits for the reply of the
+     * primary instance, at most timeout ms (-1: forever).
+     * Returns true if the primary instance has replied within the
+     * timeout, the reply (e.g., an exit code) is stored in reply_ptr.
+     * Returns false if it hasn't (hung primary instance, the caller
+     * may fall back to something else) or if this instance has become
+     * the primary instance (see isPrimaryInstance()).
+     * The reply comes back on a local socket of this instance,
+     * so this requires the Qt network module (QT_NETWORK_LIB) in every
+     * lock mode, without it, no request is sent and it returns false.
+     */
+    bool
+    requestPrimary(const QByteArray &payload, int timeout, QByteArray *reply_ptr = 0);
+
+    /**
+     * Replies to a request (primary instance), see requestReceived().
+     * Returns false if the requesting instance isn't waiting anymore.
+     */
+    bool
+    reply(const Request &request, const QByteArray &bytes);
+
+    /**
+     * Publishes a small state blob (primary instance), e.g., a listening
+     * port, a window id or the current document, at most m_state_size
+     * bytes. Every call replaces the previous state and bumps its version.
+     *
+     * In shmem mode, the state is an area of the lock segment, protected
+     * by its own sequence counter. In file and socket mode, it's a file
+     * next to the lock file (or socket), replaced atomically.
+     * The state is cleared when a new primary instance takes over.
+     * Not supported with a counting lock.
+     */
+    bool
+    publishState(const QByteArray &state);
+
+    /**
+     * State published by the primary instance, empty if none.
+     * Can be called by any instance (or a monitoring tool, which doesn't
+     * initialize the lock), it doesn't request the primary instance.
+     * The read is lock-free, only the state itself is copied.
+     * The version is stored in version_ptr (0 if nothing has been published),
+     * it changes with every publishState().
+     */
+    QByteArray
+    readPrimaryState(qint64 *version_ptr = 0);
+
+    /**
+     * Blocks until the lock is acquired, i.e., until the primary instance
+     * has exited (or its lock has become stale).
+     * Unlike isSecondaryInstance(), the primary instance is not requested.
+     * On Linux, this waits on a pidfd of the primary process, so it returns
+     * right after it has exited, without polling.
+     * Returns false in case of an error.
+     */
+    bool
+    acquire();
+
+    /**
+     * Same as acquire(), but gives up after the timeout.
+     * Returns true if the lock has been acquired.
+     */
+    bool
+    tryAcquireFor(std::chrono::milliseconds timeout);
+
+    /**
+     * Hot standby: if another instance is running, this one stays
+     * resident and returns right away (false). It takes over as soon as
+     * the primary instance has exited (or its lock has become stale)
+     * and emits promotedToPrimary(). Like acquire(), the primary
+     * instance is not requested.
+     * The wait runs on an internal thread (pidfd on Linux, no polling).
+     * If several standby instances are waiting, they take over one
+     * at a time (guard file with a kernel lock), so exactly one of them
+     * becomes the primary instance, the others go on waiting for it.
+     * The takeover is never attempted without that guard, so this
+     * requires the kernel lock (Unix), see ApplicationLock.
+     * Returns true if this instance is the primary instance already,
+     * false if it's waiting or in case of an error.
+     */
+    bool
+    startStandby();
+
+    void
+    stopStandby();
+
+    bool
+    isStandby() const;
+
+    /**
+     * Counting lock: allow up to count instances at the same time
+     * (default 1, at most m_max_slots). Each instance claims a slot,
+     * isSecondaryInstance() only returns true if all slots are held
+     * by live instances.
+     *
+     * In shmem mode, the slots are a table in the segment, each with
+     * the pid and heartbeat of its owner. A free or stale slot is claimed
+     * with a single compare-and-swap, so simultaneous launches don't
+     * serialize on the QSharedMemory semaphore. Requests and messages
+     * go to the instance in the first live slot.
+     * In file mode (Unix), each slot is a guard file with a kernel lock
+     * (see setKernelLockEnabled()), there's no heartbeat and no request.
+     * Not supported in socket mode.
+     *
+     * Must be called before the lock is initialized and all instances
+     * must use the same count.
+     */
+    void
+    setMaxInstances(int count);
+
+    int
+    maxInstances() const;
+
+    /**
+     * Slot held by this instance (counting lock), -1 if none.
+     */
+    int
+    instanceSlot() const;
+
+    /**
+     * Run the heartbeat and the request polling on an internal thread,
+     * so that the heartbeat doesn't stop while the GUI thread is busy
+     * (which would make the lock look stale to a new instance).
+     * The signals are then emitted from that thread, connections to
+     * objects in the GUI thread are queued (auto connection).
+     * The lock file isn't watched in this mode, it's polled.
+     * Must be called before the lock is initialized, not used
+     * in socket mode or with a registry.
+     */
+    void
+    setUpdateThreadEnabled(bool enable);
+
+    bool
+    isUpdateThreadEnabled() const;
+
+    /**
+     * Lease mode (file mode), for a lock in a directory that is shared
+     * between hosts (e.g., a network home directory), where the pid
+     * of a primary instance on another host can't be checked.
+     * The lock file is placed in dir, its record holds the hostname,
+     * the end of the lease and a fencing token. The heartbeat renews
+     * the lease, it's only taken over after it has expired (or if the
+     * owner process is gone, on the same host). Every new lease gets
+     * a higher fencing token, see fencingToken().
+     * The lease time should be several heartbeat intervals,
+     * the clocks of the hosts must be in sync.
+     * Must be called before the lock is initialized, the kernel lock
+     * is not used in this mode.
+     */
+    void
+    setLeaseMode(const QString &dir, int lease_time = 15000);
+
+    bool
+    isLeaseMode() const;
+
+    /**
+     * Fencing token of the lease held by this instance (lease mode),
+     * 0 if none. It increases with every new lease, so a shared resource
+     * can reject a request of a previous primary instance (e.g., after
+     * it has been suspended and its lease has been taken over).
+     */
+    qint64
+    fencingToken() const;
+
+    /**
+     * Statistics collected since the lock has been created.
+     * Thread-safe (update thread).
+     */
+    Stats
+    stats() const;
+
+    /**
+     * Emit statsUpdated() periodically (ms), 0 (default) to disable.
+     */
+    void
+    setStatsInterval(int msec);
+
 public slots:
 
     void
     updateLock();
 
+private slots:
+
+    void
+    lockFileChanged(const QString &path);
+
+    void
+    socketConnected();
+
+    void
+    socketReadyRead();
+
+    void
+    messageDirChanged();
+
+    void
+    reportStats();
+
+    void
+    promoteStandby();
+
 protected:
 
     //void
@@ -173,18 +607,162 @@ protected:
 
 private:
 
+    struct SharedSegment;
+
+    struct RequestRecord;
+
+    struct StateArea;
+
+    SharedSegment*
+    sharedSegment() const;
+
+    RequestRecord*
+    requestRecord(quint64 position) const;
+
+    StateArea*
+    stateArea() const;
+
+    bool
+    writeState(const QByteArray &state);
+
+    void
+    clearState();
+
     void
     initShmemName();
 
     void
-    initFileName();
+    initMappedName();
+
+    bool
+    mapFile(bool create, bool *created_ptr = 0);
+
+    void
+    unmapFile();
+
+    void
+    initFileName(const QString &dir = QString());
+
+    void
+    initSocketName();
+
+    QString
+    lockName() const;
+
+    bool
+    initLockOnce(bool send_request = true, qint64 heartbeat_timeout = -1);
+
+    bool
+    initSocketLock(bool send_request);
 
     bool
-    initLockOnce();
+    initSlotLock(bool send_request);
+
+    bool
+    initRobustLock(bool send_request);
+
+    bool
+    initOwnerMutex(bool created);
+
+    int
+    ownerMutexState() const;
+
+    void
+    removeBrokenObject();
+
+    void
+    unlockOwnerMutex();
+
+    void
+    startUpdateTimer();
+
+    void
+    triggerUpdate();
+
+    void
+    stopUpdateThread();
+
+    void
+    waitForPrimary();
+
+    void
+    countStat(qint64 Stats::*field, qint64 count = 1);
+
+    void
+    recordHeartbeat();
+
+    void
+    recordRequest(qint64 count, qint64 request_time = 0);
+
+    void
+    recordTakeover(qint64 age);
+
+    QString
+    slotFileName(int slot) const;
+
+    int
+    claimSlot();
+
+    bool
+    updateSlot();
+
+    void
+    releaseSlot();
+
+    bool
+    isSlotStale(quint64 value);
+
+    bool
+    isFirstLiveSlot();
+
+    bool
+    waitForProcessExit(qint64 pid, qint64 start_time, qint64 timeout);
+
+    bool
+    checkLockFile(bool force_read = false);
+
+    bool
+    waitForHeartbeat(const Segment &segment, qint64 timeout = -1);
+
+    void
+    loseLock(qint64 pid);
+
+    bool
+    claimLease(const Segment &segment, bool found);
+
+    bool
+    renewLease();
+
+    bool
+    releaseLease();
+
+    qint64
+    lockFileTime(bool *replaced_ptr = 0);
+
+    qint64
+    lockFileSeq();
+
+    bool
+    touchLockFile(qint64 ts_ms);
+
+    QFileSystemWatcher*
+    fileWatcher(bool create = true);
+
+    bool
+    watchLockFile();
+
+    int
+    lockKernelFile();
+
+    void
+    unlockKernelFile();
 
     bool
     isProcessGone(const Segment &segment);
 
+    qint64
+    staleAge(const Segment &segment) const;
+
     bool
     isOpen() const;
 
@@ -213,22 +791,49 @@ private:
     serializeSegment(const Segment &segment);
 
     bool
-    writeSegment(const QByteArray &bytes);
+    writeSegment(const Segment &segment);
 
-    bool
-    writeFile(const QByteArray &bytes);
+    QByteArray
+    serializeRecord(const QByteArray &bytes, quint32 seq);
+
+    QByteArray
+    readRecord(const QByteArray &record, quint32 *seq_ptr = 0, bool *ok_ptr = 0, bool *torn_ptr = 0);
 
     bool
-    writeLock(const QByteArray &bytes);
+    writeFile(const QByteArray &bytes, qint64 expected_seq = -1, bool *conflict_ptr = 0);
+
+    void
+    writeFileAsync(const QByteArray &bytes, qint64 expected_seq = -1);
 
     bool
     writeLock(const Segment &segment);
 
+    bool
+    sendRequest();
+
+    QByteArray
+    serializeMessage(const QStringList &args, const QByteArray &payload, const QString &reply_name = QString());
+
+    bool
+    receiveMessage(const QByteArray &bytes);
+
+    bool
+    postMessage(const QByteArray &bytes);
+
+    int
+    drainMessages();
+
+    bool
+    appendRequest(const QByteArray &bytes);
+
+    int
+    drainRequests();
+
     QString
     m_name;
 
-    bool
-    m_active = false;
+    std::atomic<bool>
+    m_active{false}; //written by the update thread (lock lost), if any
 
     bool
     m_secondary = false;
@@ -236,6 +841,9 @@ private:
     qint64
     m_primary_pid = 0;
 
+    qint64
+    m_primary_start_time = 0;
+
     int
     m_init_fail = false;
 
@@ -251,26 +859,291 @@ private:
     bool
     m_use_file = false;
 
+    bool
+    m_use_socket = false;
+
+    bool
+    m_use_mmap = false; //shmem mode, segment in a mapped file
+
+    bool
+    m_use_robust = false; //mapped, POSIX shm object with an owner mutex
+
+    bool
+    m_owner_locked = false;
+
+    bool
+    m_use_kernel_lock = false;
+
+    QScopedPointer<ApplicationLock>
+    m_kernel_lock;
+
+    QString
+    m_kernel_lock_filename;
+
     QString
     m_lock_filename;
 
+    QString
+    m_msg_dir;
+
+    QString
+    m_state_filename; //published state (file and socket mode)
+
+    qint64
+    m_state_version = 0; //file and socket mode
+
+    QByteArray
+    m_message;
+
     QSharedMemory
     m_q_shmem;
 
+    QString
+    m_mmap_filename;
+
+    void*
+    m_mmap_data = 0;
+
+    quint64
+    m_mmap_ino = 0; //inode of the mapped file (or shm object)
+
     QFile
     m_lock_file;
 
     QFileInfo
     m_lock_file_info;
 
+    QScopedPointer<QFileSystemWatcher>
+    m_lock_file_watcher; //created when needed, not used with a registry
+
+    QString
+    m_socket_name;
+
+    QString
+    m_socket_guard_filename; //serializes taking over the socket
+
+#ifdef QT_NETWORK_LIB
+    QLocalServer
+    m_local_server;
+#endif
+
     QTimer
     m_tmr_check;
 
+    QApplicationLockRegistry*
+    m_registry = 0;
+
+    QThread*
+    m_update_thread = 0;
+
+    QTimer*
+    m_thread_timer = 0; //lives in m_update_thread
+
+    std::atomic<bool>
+    m_standby{false}; //read by the standby thread
+
+    QThread*
+    m_standby_thread = 0;
+
+    QObject*
+    m_standby_context = 0; //lives in m_standby_thread
+
+    QScopedPointer<ApplicationLock>
+    m_standby_guard; //locked on m_standby_thread, see promoteStandby()
+
+    qint64
+    m_lock_file_seq = -1; //record sequence number last read (file mode), -1: unknown
+
+    qint64
+    m_stale_heartbeat = 0; //mtime of a stale-looking lock file, see waitForHeartbeat()
+
+    QElapsedTimer
+    m_stale_heartbeat_timer;
+
+    QElapsedTimer
+    m_ring_wait; //request claimed but not published yet
+
+    mutable QMutex
+    m_stats_mutex;
+
+    Stats
+    m_stats{};
+
+    qint64
+    m_stats_jitter_total = 0;
+
+    QElapsedTimer
+    m_heartbeat_timer;
+
+    QTimer
+    m_tmr_stats;
+
+    std::atomic<int>
+    m_update_interval{0}; //read by the update and standby threads
+
+    int
+    m_stale_timeout = 15000;
+
+    int
+    m_max_missed = 0;
+
+    int
+    m_max_instances = 1;
+
+    int
+    m_slot = -1;
+
+    int
+    m_lease_time = 0; //lease mode (ms), 0: off
+
     qint64
-    m_lock_file_last_updated = 0;
+    m_lease_token = 0;
+
+    qint64
+    m_generation = 0;
+
+    qint64
+    m_requests_seen = 0; //request count of the lock file record handled (file mode)
+
+    static constexpr int
+    m_seg_size = 1024*320;
+
+    static constexpr quint32
+    m_seg_magic = 0x514c434b; //QLCK
+
+    static constexpr quint32
+    m_seg_version = 10;
+
+    static constexpr int
+    m_read_retries = 1000;
+
+    static constexpr int
+    m_socket_timeout = 1000;
+
+    static constexpr int
+    m_msg_offset = 1024*4;
+
+    static constexpr int
+    m_max_slots = 64;
+
+    static constexpr int
+    m_msg_size = 1024*16;
+
+    static constexpr int
+    m_ring_size = 16;
 
     static constexpr int
-    m_seg_size = 1024*64;
+    m_state_offset = 1024*264; //behind the request ring
+
+    static constexpr int
+    m_state_size = 1024*16;
+
+    static constexpr int
+    m_msg_max_files = 64;
+
+};
+
+Q_DECLARE_METATYPE(QApplicationLock::Stats)
+Q_DECLARE_METATYPE(QApplicationLock::Request)
+
+inline QApplicationLock::Scope
+operator|(QApplicationLock::Scope a, QApplicationLock::Scope b)
+{
+    return static_cast<QApplicationLock::Scope>((int)a | (int)b);
+}
+
+/**
+ * QApplicationLockRegistry manages many named locks,
+ * e.g., one per opened project or resource.
+ *
+ * Instead of one timer per lock, all heartbeats are driven by a single
+ * coarse timer of the registry, so all locks are updated in one wakeup.
+ * The timer is a very coarse timer (second accuracy), which lets the
+ * system coalesce it with other timers, and it's only running
+ * while at least one lock needs a heartbeat.
+ * The registry's update interval is used for all its locks (and stored
+ * in the lock), so other instances know when a heartbeat is overdue.
+ * The lock files (file mode) are watched by a single file watcher
+ * of the registry (one inotify instance on Linux), not one per lock.
+ */
+class QApplicationLockRegistry : public QObject
+{
+    Q_OBJECT
+
+    friend class QApplicationLock;
+
+public:
+
+    QApplicationLockRegistry(QObject *parent = 0);
+    ~QApplicationLockRegistry();
+
+    /**
+     * Returns the lock with the given name, it's created if it doesn't
+     * exist yet (not initialized, call isSecondaryInstance() on it).
+     * The lock is owned by the registry, see release().
+     */
+    QApplicationLock*
+    lock(const QString &name, QApplicationLock::Scope scope = QApplicationLock::Scope::User);
+
+    /**
+     * Returns the lock with the given name, 0 if there's none.
+     */
+    QApplicationLock*
+    find(const QString &name) const;
+
+    /**
+     * Removes and deletes the lock, which releases it.
+     */
+    void
+    release(const QString &name);
+
+    QStringList
+    names() const;
+
+    /**
+     * Heartbeat interval (ms) of all locks, defaults to 3000.
+     */
+    void
+    setUpdateInterval(int msec);
+
+    int
+    updateInterval() const;
+
+public slots:
+
+    void
+    updateLocks();
+
+private slots:
+
+    void
+    lockFileChanged(const QString &path);
+
+    void
+    messageDirChanged(const QString &path);
+
+private:
+
+    void
+    scheduleUpdates(QApplicationLock *lock);
+
+    void
+    remove(QApplicationLock *lock);
+
+    QMap<QString, QApplicationLock*>
+    m_locks;
+
+    QSet<QApplicationLock*>
+    m_scheduled;
+
+    QTimer
+    m_timer;
+
+    QFileSystemWatcher
+    m_file_watcher; //lock files and message directories of all locks
+
+    int
+    m_update_interval = 3000;
 
 };
 
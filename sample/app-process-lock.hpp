@@ -0,0 +1 @@
+../app-process-lock.hpp
\ No newline at end of file
@@ -7,6 +7,12 @@ int main(int argc, char *argv[])
 
     QApplicationLock lock;
     //QApplicationLock lock("", QApplicationLock::Scope::Global);
+
+    //Lease mode, lock in a (shared) directory: --lease DIR
+    int lease_arg = app.arguments().indexOf("--lease");
+    if (lease_arg != -1 && lease_arg + 1 < app.arguments().size())
+        lock.setLeaseMode(app.arguments().at(lease_arg + 1));
+
     qint64 pid = 0;
     if (lock.isSecondaryInstance(&pid))
     {